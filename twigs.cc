@@ -10,6 +10,11 @@
 //
 
 #include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include <util/delay_basic.h>
 
 #include "avrlib/adc.h"
 #include "avrlib/boot.h"
@@ -19,40 +24,129 @@
 using namespace avrlib;
 
 // Hardware
-Gpio<PortD, 4> in_1;
-Gpio<PortD, 3> out_1_a;
-Gpio<PortD, 0> out_1_b;
-Gpio<PortD, 1> led_1_a;
-Gpio<PortD, 2> led_1_k;
+// The pins of each channel are bound at compile time, so every pin access compiles
+// down to a single instruction
+template<typename GateInput, typename OutputA, typename OutputB,
+         typename LedAnode, typename LedCathode, typename Button>
+struct ChannelPinBinding {
+  static inline void GateInputInit() {
+    GateInput::set_mode(DIGITAL_INPUT);
+    GateInput::High();
+  }
+  static inline void ButtonInit() {
+    Button::set_mode(DIGITAL_INPUT);
+    Button::High();
+  }
+  static inline void GateOutputInit() {
+    OutputA::set_mode(DIGITAL_OUTPUT);
+    OutputB::set_mode(DIGITAL_OUTPUT);
+  }
+  static inline void LedInit() {
+    LedAnode::set_mode(DIGITAL_OUTPUT);
+    LedCathode::set_mode(DIGITAL_OUTPUT);
+    LedOff();
+  }
+  static inline bool GateInputRead() { return !GateInput::value(); }
+  static inline bool ButtonRead() { return !Button::value(); }
+  static inline void GateOutputOn() {
+    OutputA::High();
+    OutputB::High();
+  }
+  static inline void GateOutputOff() {
+    OutputA::Low();
+    OutputB::Low();
+  }
+  static inline void LedOff() {
+    LedAnode::Low();
+    LedCathode::Low();
+  }
+  static inline void LedGreen() {
+    LedAnode::Low();
+    LedCathode::High();
+  }
+  static inline void LedRed() {
+    LedAnode::High();
+    LedCathode::Low();
+  }
+};
 
-Gpio<PortD, 7> in_2;
-Gpio<PortD, 6> out_2_a;
-Gpio<PortD, 5> out_2_b;
-Gpio<PortB, 1> led_2_a;
-Gpio<PortB, 0> led_2_k;
+// The pins and timer compares of each channel
+// Code that knows its channel at compile time, like the interrupts and the loop, uses
+// these directly. The functions that take a channel number switch between them
+template<uint8_t channel> struct ChannelPins;
+
+template<> struct ChannelPins<0>
+  : ChannelPinBinding<Gpio<PortD, 4>, Gpio<PortD, 3>, Gpio<PortD, 0>,
+                      Gpio<PortD, 1>, Gpio<PortD, 2>, Gpio<PortC, 3> > {
+  static inline volatile uint16_t& GateCompare() { return OCR1A; }
+  static inline volatile uint8_t& AudioCompare() { return OCR2A; }
+  enum {
+    GATE_COMPARE_ENABLE = _BV(OCIE1A),
+    GATE_COMPARE_FLAG = _BV(OCF1A),
+    AUDIO_COMPARE_ENABLE = _BV(OCIE2A),
+    AUDIO_COMPARE_FLAG = _BV(OCF2A)
+  };
+};
 
-Gpio<PortC, 2> button_2;
-Gpio<PortC, 3> button_1;
+template<> struct ChannelPins<1>
+  : ChannelPinBinding<Gpio<PortD, 7>, Gpio<PortD, 6>, Gpio<PortD, 5>,
+                      Gpio<PortB, 1>, Gpio<PortB, 0>, Gpio<PortC, 2> > {
+  static inline volatile uint16_t& GateCompare() { return OCR1B; }
+  static inline volatile uint8_t& AudioCompare() { return OCR2B; }
+  enum {
+    GATE_COMPARE_ENABLE = _BV(OCIE1B),
+    GATE_COMPARE_FLAG = _BV(OCF1B),
+    AUDIO_COMPARE_ENABLE = _BV(OCIE2B),
+    AUDIO_COMPARE_FLAG = _BV(OCF2B)
+  };
+};
 
 // Global
 #define SYSTEM_NUM_CHANNELS 2
+// Pipeline
+// Stages after the first in each channel's pipeline run on virtual channels, which
+// have function state but no hardware. They're allocated in order from a fixed
+// size arena shared by both channels
+#define PIPELINE_ARENA_SIZE 4
+#define SYSTEM_NUM_FUNCTION_CHANNELS (SYSTEM_NUM_CHANNELS + PIPELINE_ARENA_SIZE)
 // Gate inputs
 // Top input must be the reset function since the two inputs are hardware normaled
 #define GATE_INPUT_RESET_INDEX 0
 #define GATE_INPUT_TRIG_INDEX 1
+// A reset that arrives within this many ticks after a trig is applied before it, so
+// that the trig is the downbeat. Trigs are held back for this long to wait for a reset
+#define GATE_INPUT_COINCIDENCE_WINDOW_DEFAULT 4 // 0.128ms * 4 = 0.512ms
+// Glitch filter. Times are measured in whole ticks, so a time only counts once one
+// more tick than set has been counted, and 0 turns the check off
+// Pulses must stay high for at least this many ticks to count
+#define GATE_INPUT_MIN_HIGH_TIME_DEFAULT 1
+// Pulses that start less than this many ticks after the last one are ignored
+#define GATE_INPUT_MIN_RETRIGGER_TIME_DEFAULT 2
+// When enabled, each input change is confirmed by a majority of 3 samples
+#define GATE_INPUT_MAJORITY_SAMPLING_DEFAULT 1
+// Delay between majority samples, in units of 3 cycles. 8 * 3 / 8MHz = 3us
+#define GATE_INPUT_MAJORITY_SAMPLE_DELAY 8
 // Buttons
 #define BUTTON_LONG_PRESS_DURATION 9375 // 1200 * 8000 / 1024
 // LEDs
-#define LED_THRU_GATE_DURATION 0x100
-#define LED_FACTORED_GATE_DURATION 0x080
+#define LED_THRU_GATE_DURATION 200 // 0.128ms * 200 = 25.6ms
+#define LED_FACTORED_GATE_DURATION 100 // 0.128ms * 100 = 12.8ms
 #define PULSE_TRACKER_BUFFER_SIZE 2
+// The clock is taken to have stopped after this many periods without an input
+#define PULSE_TRACKER_TIMEOUT_PERIODS 3
+// Half the timer's range, after which a tracked event is late enough to notice a wrap
+#define PULSE_TRACKER_LATE_ELAPSED 0x8000
 // ADC
 #define ADC_DELTA_THRESHOLD 4 // ignore ADC updates less than this absolute value
 #define ADC_MAX_VALUE 250
-// amount of cycles between adc scans. higher number = better performace
-#define ADC_POLL_RATIO 5 // 1:5
+// The pots and CV inputs are scanned on Timer0, so that the cpu can sleep between scans
+#define ADC_SCAN_TIMER_PRESCALER 5 // clk/1024
+#define ADC_SCAN_PERIOD 16 // 0.128ms * 16 = 2.048ms
 // Common function values
 #define FUNCTION_TIMING_ERROR_CORRECTION_AMOUNT 12
+// When enabled, factor and swing changes are held until the next input, so that
+// they never land in the middle of a period
+#define FUNCTION_PHASE_CONTINUOUS_DEFAULT 0
 // Swing
 #define SWING_FACTOR_MIN 50
 // Swing maximum amount can be adjusted up to 99
@@ -71,108 +165,298 @@ Gpio<PortC, 3> button_1;
 // multiplying
 #define FACTORER_BYPASS_INDEX 7
 #define FACTORER_BYPASS_VALUE 1
+// Audio rate factorer
+// Timer2 runs at clk/8, so one audio timer tick is 1us
+#define AUDIO_TIMER_PRESCALER 2
+// The shortest output half period that the compare interrupt can reliably schedule
+#define AUDIO_INTERVAL_MIN 64
+// The longest single hop of the 8 bit compare register
+#define AUDIO_INTERVAL_STEP_MAX 0x80
+
+// Looper
+// The pattern is quantized to this many steps per input period
+#define LOOPER_STEPS_PER_BEAT 4
+// Loop lengths are 1, 2, 4 ... 64 input periods
+#define LOOPER_NUM_LENGTHS 7
+// The longest loop, which must be a power of two no larger than 256
+#define LOOPER_NUM_STEPS 256
+#define LOOPER_PATTERN_SIZE (LOOPER_NUM_STEPS / 8)
+
+// Internal clock
+// Timer ticks in a minute, 60 * 8000000 / 1024
+#define INTERNAL_CLOCK_TICKS_PER_MINUTE 468750UL
+// The pot/CV input selects from this tempo up
+#define INTERNAL_CLOCK_BPM_MIN 40
+// Taps further apart or closer together than these tempos are ignored
+#define INTERNAL_CLOCK_TAP_BPM_MIN 30
+#define INTERNAL_CLOCK_TAP_BPM_MAX 300
+#define INTERNAL_CLOCK_TAP_INTERVAL_MIN (INTERNAL_CLOCK_TICKS_PER_MINUTE / INTERNAL_CLOCK_TAP_BPM_MAX)
+#define INTERNAL_CLOCK_TAP_INTERVAL_MAX (INTERNAL_CLOCK_TICKS_PER_MINUTE / INTERNAL_CLOCK_TAP_BPM_MIN)
 
 // Timer counter max value
 #define TCNT1_MAX 0xffff
 
+// Eeprom
+// Configuration byte written by earlier versions that only had two functions
+#define EEPROM_ADDRESS_CONFIGURATION 0
+// One byte per channel holding that channel's function
+#define EEPROM_ADDRESS_CHANNEL_FUNCTION 1
+#define EEPROM_ADDRESS_CHANNEL_ROUTING (EEPROM_ADDRESS_CHANNEL_FUNCTION + SYSTEM_NUM_CHANNELS)
+// For each channel, a byte with the number of extra pipeline stages, followed by a
+// function byte and a control value byte (0 - ADC_MAX_VALUE) for each stage
+#define EEPROM_ADDRESS_PIPELINE (EEPROM_ADDRESS_CHANNEL_ROUTING + 1)
+#define EEPROM_PIPELINE_RECORD_SIZE (1 + 2 * PIPELINE_ARENA_SIZE)
+// Settings, one byte each. Erased eeprom selects the default value
+#define EEPROM_ADDRESS_SETTINGS (EEPROM_ADDRESS_PIPELINE + SYSTEM_NUM_CHANNELS * EEPROM_PIPELINE_RECORD_SIZE)
+#define EEPROM_ADDRESS_COINCIDENCE_WINDOW EEPROM_ADDRESS_SETTINGS
+#define EEPROM_ADDRESS_MIN_HIGH_TIME (EEPROM_ADDRESS_SETTINGS + 1)
+#define EEPROM_ADDRESS_MIN_RETRIGGER_TIME (EEPROM_ADDRESS_SETTINGS + 2)
+#define EEPROM_ADDRESS_MAJORITY_SAMPLING (EEPROM_ADDRESS_SETTINGS + 3)
+#define EEPROM_ADDRESS_PHASE_CONTINUOUS (EEPROM_ADDRESS_SETTINGS + 4)
+// One byte per channel
+#define EEPROM_ADDRESS_GATE_LENGTH (EEPROM_ADDRESS_SETTINGS + 5)
+#define EEPROM_ADDRESS_IDLE (EEPROM_ADDRESS_SETTINGS + 7)
+// Room is left for more settings
+#define EEPROM_SETTINGS_SIZE 8
+// The looper pattern of each channel, stored complemented so that erased eeprom
+// is an empty pattern
+#define EEPROM_ADDRESS_LOOPER_PATTERN (EEPROM_ADDRESS_SETTINGS + EEPROM_SETTINGS_SIZE)
+
+// Probability
+#define PROBABILITY_MAX 100
+
 // Trigger length 0.128ms * 20 = 2.56ms
 // If you don't need to extend trigger length, set this value to 0
-#define TRIGGER_EXTEND_COUNT 20
+#define TRIGGER_EXTEND_DURATION 20
+
+// Gate length
+// Outputs can stay high for a percentage of the time until the next output instead
+// of a fixed trigger. 0 selects triggers
+#define GATE_LENGTH_DEFAULT 0
+#define GATE_LENGTH_MAX 95
+// The length of timer scheduled triggers, in timer ticks
+#define GATE_TRIGGER_LENGTH TRIGGER_EXTEND_DURATION
+
+// Idle
+// When nothing is pending, the cpu sleeps until the next interrupt
+#define SYSTEM_IDLE_DEFAULT 1
+
+// Available functions
+enum ChannelFunction {
+  CHANNEL_FUNCTION_FACTORER,
+  CHANNEL_FUNCTION_SWING,
+  CHANNEL_FUNCTION_AUDIO_FACTORER,
+  CHANNEL_FUNCTION_PROBABILITY,
+  CHANNEL_FUNCTION_LOOPER,
+  CHANNEL_FUNCTION_INTERNAL_CLOCK,
+  CHANNEL_FUNCTION_LAST
+};
+
+// Where the second channel takes its input from
+enum ChannelRouting {
+  CHANNEL_ROUTING_PARALLEL, // both channels follow the trig input
+  CHANNEL_ROUTING_CHAINED, // channel 2 follows the output of channel 1
+  CHANNEL_ROUTING_LAST
+};
+
+// State of a channel's function. Virtual channels have one too
+//
+// Functions are handed a pointer to this, so that their state is reached with
+// displacement addressing from one base pointer rather than an indexed address
+// per access
+struct FunctionState {
+  ChannelFunction function;
+  // Virtual channels take their control value from the pipeline configuration
+  int16_t adc_value;
+  // Common function vars
+  uint16_t pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE];
+  uint16_t last_action_at;
+  uint8_t pulse_tracker_recorded_count : 2;
+  uint8_t exec_state : 2;
+  // A new control value that's held until the next input
+  uint8_t is_value_pending : 1;
+  // Swing
+  uint8_t swing_counter : 2;
+  // Has the time since the last tracked event passed half the timer's range?
+  uint8_t pulse_tracker_is_late : 1;
+  int8_t factor;
+  // Multiply
+  // Strikes emitted since the last thru, and the elapsed time since the thru at which
+  // the next one is due
+  uint8_t multiply_strike_count;
+  uint16_t multiply_next_strike_at;
+  // Divide
+  int8_t divide_counter;
+  // Swing
+  uint8_t swing;
+  // Probability
+  uint8_t probability;
+};
+
+// State of a channel's controls and outputs
+struct ChannelState {
+  // Buttons
+  uint8_t button_state : 1;
+  uint8_t button_is_inhibited : 1;
+  // Was the last press a tap of the internal clock, recent enough to time the next one?
+  uint8_t button_is_tap_valid : 1;
+  // LEDs
+  uint8_t led_state : 2;
+  // Gate length, changed by turning the pot while holding the button
+  uint8_t is_gate_length_edited : 1;
+  // Outputs
+  uint8_t is_trigger_extended : 1;
+  uint8_t gate_length;
+  // Gate length as a Q16 fraction, read by the timer compare interrupt
+  uint16_t gate_length_fraction;
+  uint16_t trigger_at;
+  uint16_t led_gate_duration;
+  uint16_t led_on_at;
+  uint16_t button_last_press_at;
+};
+
+// State of a gate input, shared with the pin change interrupt
+struct GateInputState {
+  bool state;
+  bool is_rising_edge;
+  uint16_t rising_edge_at;
+  // The start of the last pulse that was handled
+  uint16_t pulse_at;
+};
+
+// State of a channel's audio rate factorer, shared with the interrupts. An audio
+// factor of 0 means that the channel isn't in audio rate mode
+struct AudioState {
+  int8_t factor;
+  bool output_state;
+  uint8_t edge_count;
+  uint8_t toggles_remaining;
+  uint8_t toggles_per_period;
+  uint8_t interval_remainder;
+  uint8_t interval_error;
+  bool has_period;
+  uint16_t last_rise_at;
+  uint16_t interval;
+  uint16_t wait;
+};
+
+// State of a channel's pattern looper
+struct LooperState {
+  // One bit per step
+  uint8_t pattern[LOOPER_PATTERN_SIZE];
+  // The loop length in steps, less one
+  uint8_t length_mask;
+  // The step at the start of the current input period, and the steps since then
+  uint8_t beat_step;
+  uint8_t sub_step;
+  uint8_t is_armed : 1;
+  uint8_t is_recording : 1;
+  // The next input starts the loop over
+  uint8_t is_at_start : 1;
+  // The elapsed time since the input at which the current and next steps are due
+  uint16_t step_at;
+  uint16_t next_step_at;
+  // Pattern bytes that are still to be written to the eeprom
+  uint8_t save_remaining;
+};
+
+// State of a channel's internal clock. Ticks are made by the timer compare interrupt
+// and taken by the loop
+struct InternalClockState {
+  uint16_t period;
+  // The output is raised at each tick and ended by the next compare
+  bool is_high;
+  uint16_t rise_at;
+  bool is_pending;
+  uint16_t pending_at;
+  // The tick taken on this cycle
+  bool is_tick;
+  uint16_t tick_at;
+};
 
 // Adc
 AdcInputScanner adc;
 uint8_t adc_counter;
-int16_t adc_value[SYSTEM_NUM_CHANNELS];
+// Set by Timer0 when the next scan is due
+volatile bool adc_is_scan_due;
 
 // Gate input
-bool gate_input_state[SYSTEM_NUM_CHANNELS];
+// Edges are detected and timestamped by the pin change interrupt
+volatile GateInputState gate_input[SYSTEM_NUM_CHANNELS];
+uint8_t gate_input_coincidence_window;
+uint8_t gate_input_min_high_time;
+uint8_t gate_input_min_retrigger_time;
+bool gate_input_is_majority_sampled;
 
-// Buttons
-bool button_state[SYSTEM_NUM_CHANNELS];
-bool button_is_inhibited[SYSTEM_NUM_CHANNELS];
-uint16_t button_last_press_at[SYSTEM_NUM_CHANNELS];
+// Function settings
+bool function_is_phase_continuous;
 
-// LEDs
-uint8_t led_state[SYSTEM_NUM_CHANNELS];
-uint16_t led_gate_duration[SYSTEM_NUM_CHANNELS];
+// Idle
+bool system_is_idle_enabled;
 
 // Channel state
-uint16_t channel_last_action_at[SYSTEM_NUM_CHANNELS];
-uint8_t exec_state[SYSTEM_NUM_CHANNELS];
-uint8_t trigger_extend_count[SYSTEM_NUM_CHANNELS];
+ChannelState channel_state[SYSTEM_NUM_CHANNELS];
+FunctionState function_state[SYSTEM_NUM_FUNCTION_CHANNELS];
 
-// Available functions
-enum ChannelFunction {
-  CHANNEL_FUNCTION_FACTORER,
-  CHANNEL_FUNCTION_SWING,
-  CHANNEL_FUNCTION_LAST
-};
-// Default functions
-ChannelFunction channel_function_[SYSTEM_NUM_CHANNELS] = {
-  CHANNEL_FUNCTION_SWING,
-  CHANNEL_FUNCTION_FACTORER
-};
+ChannelRouting channel_routing = CHANNEL_ROUTING_PARALLEL;
 
-// Common function vars
-uint16_t pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE];
-uint16_t pulse_tracker_recorded_count;
-int16_t factor[SYSTEM_NUM_CHANNELS];
+// Pipeline
+// The first virtual channel and the number of virtual channels for each channel's pipeline
+uint8_t pipeline_first_stage[SYSTEM_NUM_CHANNELS];
+uint8_t pipeline_num_stages[SYSTEM_NUM_CHANNELS];
 
-// Multiply
-bool multiply_is_debouncing[SYSTEM_NUM_CHANNELS];
+// Probability
+uint16_t random_state = 0xace1;
 
-// Divide
-int8_t divide_counter[SYSTEM_NUM_CHANNELS];
+// Looper
+LooperState looper_state[SYSTEM_NUM_CHANNELS];
 
-// Swing
-int16_t swing[SYSTEM_NUM_CHANNELS];
-int8_t swing_counter[SYSTEM_NUM_CHANNELS];
+// Internal clock
+volatile InternalClockState internal_clock[SYSTEM_NUM_CHANNELS];
+
+// Audio rate factorer
+volatile AudioState audio_state[SYSTEM_NUM_CHANNELS];
+volatile uint8_t audio_clock_high;
 
 void ClockInit();
+void AudioInit();
+void InternalClockUpdateInterrupts(uint8_t channel);
 
 // Initialize the gate inputs (used for trig/reset)
 void GateInputsInit() {
-  in_1.set_mode(DIGITAL_INPUT);
-  in_1.High();
-  gate_input_state[0] = false;
+  ChannelPins<0>::GateInputInit();
+  ChannelPins<1>::GateInputInit();
+  gate_input[0].state = gate_input[1].state = false;
 
-  in_2.set_mode(DIGITAL_INPUT);
-  in_2.High();
-  gate_input_state[1] = false;
+  // pin change interrupt for both inputs
+  PCMSK2 |= _BV(PCINT20) | _BV(PCINT23);
+  PCICR |= _BV(PCIE2);
 }
 
 // Initialize the push buttons
 void ButtonsInit() {
-  button_1.set_mode(DIGITAL_INPUT);
-  button_2.set_mode(DIGITAL_INPUT);
-  button_1.High();
-  button_2.High();
+  ChannelPins<0>::ButtonInit();
+  ChannelPins<1>::ButtonInit();
+
+  channel_state[0].button_state = channel_state[1].button_state = false;
 
-  button_state[0] = button_state[1] = false;
+  // pin change interrupt for both buttons, which only wakes the cpu from idle
+  PCMSK1 |= _BV(PCINT10) | _BV(PCINT11);
+  PCICR |= _BV(PCIE1);
 }
 
 // Initialize the outputs
 void GateOutputsInit() {
-  out_1_a.set_mode(DIGITAL_OUTPUT);
-  out_1_b.set_mode(DIGITAL_OUTPUT);
-  out_2_a.set_mode(DIGITAL_OUTPUT);
-  out_2_b.set_mode(DIGITAL_OUTPUT);
+  ChannelPins<0>::GateOutputInit();
+  ChannelPins<1>::GateOutputInit();
 }
 
 // Initialize the LEDs
 void LedsInit() {
-  led_1_a.set_mode(DIGITAL_OUTPUT);
-  led_1_k.set_mode(DIGITAL_OUTPUT);
-
-  led_2_a.set_mode(DIGITAL_OUTPUT);
-  led_2_k.set_mode(DIGITAL_OUTPUT);
+  ChannelPins<0>::LedInit();
+  ChannelPins<1>::LedInit();
 
-  led_1_a.Low();
-  led_2_a.Low();
-  led_1_k.Low();
-  led_2_k.Low();
-
-  led_state[0] = led_state[1] = 0;
+  channel_state[0].led_state = channel_state[1].led_state = 0;
 }
 
 // The value for the pot/CV input for the given channel
@@ -182,14 +466,14 @@ inline int16_t AdcReadValue(uint8_t channel) {
 }
 
 // Cache the adc value for the given channel
-inline void AdcSetValue(uint8_t channel, int16_t value) {
+inline void AdcSetValue(FunctionState* f, int16_t value) {
   // store control value
-  adc_value[channel] = ADC_MAX_VALUE - value;
+  f->adc_value = ADC_MAX_VALUE - value;
   // appears to be variance between channels, so limit the value
-  if (adc_value[channel] < 0) {
-    adc_value[channel] = 0;
-  } else if (adc_value[channel] > ADC_MAX_VALUE) {
-    adc_value[channel] = ADC_MAX_VALUE;
+  if (f->adc_value < 0) {
+    f->adc_value = 0;
+  } else if (f->adc_value > ADC_MAX_VALUE) {
+    f->adc_value = ADC_MAX_VALUE;
   }
 }
 
@@ -200,28 +484,125 @@ void AdcInit() {
   Adc::set_reference(ADC_DEFAULT);
   Adc::set_alignment(ADC_LEFT_ALIGNED);
   adc_counter = 1;
+  adc_is_scan_due = false;
+  // Timer0 paces the scans and wakes the cpu for them
+  TCCR0A = _BV(WGM01);
+  OCR0A = ADC_SCAN_PERIOD - 1;
+  TCCR0B = ADC_SCAN_TIMER_PRESCALER;
+  TIMSK0 = _BV(OCIE0A);
 
   // set initial value
   for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
-    AdcSetValue(i, AdcReadValue(i));
+    AdcSetValue(&function_state[i], AdcReadValue(i));
+  }
+}
+
+// Load each channel's extra pipeline stages from the eeprom, allocating virtual
+// channels from the arena until it's full
+// Audio rate, looper and internal clock stages can't be pipelined, so a pipeline ends at an invalid stage
+void PipelineLoadState() {
+  uint8_t stage = SYSTEM_NUM_CHANNELS;
+  for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
+    uint8_t* record = (uint8_t*) (EEPROM_ADDRESS_PIPELINE + i * EEPROM_PIPELINE_RECORD_SIZE);
+    uint8_t num_stages = eeprom_read_byte(record);
+    pipeline_first_stage[i] = stage;
+    pipeline_num_stages[i] = 0;
+    for (uint8_t j = 0; j < num_stages && stage < SYSTEM_NUM_FUNCTION_CHANNELS; ++j) {
+      uint8_t function = eeprom_read_byte(record + 1 + j * 2);
+      uint8_t value = eeprom_read_byte(record + 2 + j * 2);
+      if (function >= CHANNEL_FUNCTION_LAST ||
+          function == CHANNEL_FUNCTION_AUDIO_FACTORER ||
+          function == CHANNEL_FUNCTION_LOOPER ||
+          function == CHANNEL_FUNCTION_INTERNAL_CLOCK ||
+          value > ADC_MAX_VALUE) {
+        break;
+      }
+      function_state[stage].function = static_cast<ChannelFunction>(function);
+      function_state[stage].adc_value = value;
+      ++pipeline_num_stages[i];
+      ++stage;
+    }
+  }
+}
+
+// Load the given channel's looper pattern from the eeprom
+void LooperLoadState(uint8_t channel) {
+  uint8_t* pattern = looper_state[channel].pattern;
+  eeprom_read_block(pattern, (const void*) (EEPROM_ADDRESS_LOOPER_PATTERN + channel * LOOPER_PATTERN_SIZE),
+    LOOPER_PATTERN_SIZE);
+  for (uint8_t i = 0; i < LOOPER_PATTERN_SIZE; ++i) {
+    pattern[i] = ~pattern[i];
+  }
+}
+
+// Set the gate length for the given channel, in percent
+void GateLengthSet(uint8_t channel, uint8_t gate_length) {
+  ChannelState* c = &channel_state[channel];
+  c->gate_length = gate_length;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    c->gate_length_fraction = (static_cast<uint32_t>(gate_length) << 16) / 100;
   }
 }
 
+// Load the setting stored at the given eeprom address
+// Erased or out of range values load the given default
+uint8_t SettingLoad(uint8_t address, uint8_t default_value, uint8_t max_value) {
+  uint8_t value = eeprom_read_byte((uint8_t*) address);
+  return (value > max_value) ? default_value : value;
+}
+
 // Load the stored system settings from the eeprom
 // Currently, this consists of which functions are active on each channel
+// and how the inputs are handled
 void SystemLoadState() {
-  uint8_t configuration_byte = ~eeprom_read_byte((uint8_t*) 0);
+  // Default functions
+  function_state[0].function = CHANNEL_FUNCTION_SWING;
+  function_state[1].function = CHANNEL_FUNCTION_FACTORER;
+
+  uint8_t configuration_byte = ~eeprom_read_byte((uint8_t*) EEPROM_ADDRESS_CONFIGURATION);
   // byte values 1 2 4 8
   for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
     uint8_t b = (i+1) * (i+1);
     if (configuration_byte & b) {
-      channel_function_[i] = CHANNEL_FUNCTION_FACTORER;
+      function_state[i].function = CHANNEL_FUNCTION_FACTORER;
     } else if (configuration_byte & (b * 2)) {
-      channel_function_[i] = CHANNEL_FUNCTION_SWING;
+      function_state[i].function = CHANNEL_FUNCTION_SWING;
+    }
+  }
+  // Functions are stored offset by one, so that erased eeprom (0 once complemented)
+  // leaves the above in place
+  for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
+    uint8_t function = ~eeprom_read_byte((uint8_t*) (EEPROM_ADDRESS_CHANNEL_FUNCTION + i));
+    if (function > 0 && function <= CHANNEL_FUNCTION_LAST) {
+      function_state[i].function = static_cast<ChannelFunction>(function - 1);
     }
   }
+  uint8_t routing = ~eeprom_read_byte((uint8_t*) EEPROM_ADDRESS_CHANNEL_ROUTING);
+  if (routing < CHANNEL_ROUTING_LAST) {
+    channel_routing = static_cast<ChannelRouting>(routing);
+  }
+  PipelineLoadState();
+  for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
+    LooperLoadState(i);
+  }
+  gate_input_coincidence_window = SettingLoad(EEPROM_ADDRESS_COINCIDENCE_WINDOW,
+    GATE_INPUT_COINCIDENCE_WINDOW_DEFAULT, 0xfe);
+  gate_input_min_high_time = SettingLoad(EEPROM_ADDRESS_MIN_HIGH_TIME,
+    GATE_INPUT_MIN_HIGH_TIME_DEFAULT, 0xfe);
+  gate_input_min_retrigger_time = SettingLoad(EEPROM_ADDRESS_MIN_RETRIGGER_TIME,
+    GATE_INPUT_MIN_RETRIGGER_TIME_DEFAULT, 0xfe);
+  gate_input_is_majority_sampled = SettingLoad(EEPROM_ADDRESS_MAJORITY_SAMPLING,
+    GATE_INPUT_MAJORITY_SAMPLING_DEFAULT, 1);
+  function_is_phase_continuous = SettingLoad(EEPROM_ADDRESS_PHASE_CONTINUOUS,
+    FUNCTION_PHASE_CONTINUOUS_DEFAULT, 1);
+  for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
+    GateLengthSet(i, SettingLoad(EEPROM_ADDRESS_GATE_LENGTH + i, GATE_LENGTH_DEFAULT, GATE_LENGTH_MAX));
+  }
+  system_is_idle_enabled = SettingLoad(EEPROM_ADDRESS_IDLE, SYSTEM_IDLE_DEFAULT, 1);
 }
 
+void FunctionHandleNewAdcValue(uint8_t channel);
+
 // Initialize the system
 void SystemInit() {
   Gpio<PortB, 4>::set_mode(DIGITAL_OUTPUT);
@@ -236,121 +617,224 @@ void SystemInit() {
   AdcInit();
 
   SystemLoadState();
+  for (uint8_t i = 0; i < SYSTEM_NUM_FUNCTION_CHANNELS; ++i) {
+    FunctionHandleNewAdcValue(i);
+  }
 
   TCCR1A = 0;
   TCCR1B = 5;
+
+  AudioInit();
+  for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
+    InternalClockUpdateInterrupts(i);
+  }
+  sei();
 }
 
-// Read the value of the given gate input
-inline bool GateInputRead(uint8_t channel) {
-  return channel == 0 ? !in_1.value() : !in_2.value();
+// Read the value of the given gate input, confirmed by a majority of samples if enabled
+// Only call from the pin change interrupt
+template<uint8_t channel>
+inline bool GateInputReadFiltered() {
+  typedef ChannelPins<channel> Pins;
+  if (!gate_input_is_majority_sampled) {
+    return Pins::GateInputRead();
+  }
+  uint8_t votes = Pins::GateInputRead();
+  _delay_loop_1(GATE_INPUT_MAJORITY_SAMPLE_DELAY);
+  votes += Pins::GateInputRead();
+  _delay_loop_1(GATE_INPUT_MAJORITY_SAMPLE_DELAY);
+  votes += Pins::GateInputRead();
+  return votes >= 2;
+}
+
+// The current time. The 16 bit timer read is shared with the interrupts, so it's
+// done with them disabled
+inline uint16_t ClockNow() {
+  uint16_t now;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    now = TCNT1;
+  }
+  return now;
 }
 
 // Read the value of the given button
 bool ButtonRead(uint8_t channel) {
-  return channel == 0 ? !button_1.value() : !button_2.value();
+  return channel == 0 ? ChannelPins<0>::ButtonRead() : ChannelPins<1>::ButtonRead();
 }
 
-// Set the given output to high
-inline void GateOutputOn(uint8_t channel) {
-  switch (channel) {
-    case 0: out_1_a.High();
-            out_1_b.High();
-            break;
-    case 1: out_2_a.High();
-            out_2_b.High();
-            break;
-  }
+// Schedule the given channel's timer compare the given number of ticks from now
+// Only call with interrupts disabled
+template<uint8_t channel>
+inline void GateCompareSchedule(uint16_t delay) {
+  typedef ChannelPins<channel> Pins;
+  Pins::GateCompare() = TCNT1 + delay;
+  TIFR1 = Pins::GATE_COMPARE_FLAG;
+  TIMSK1 |= Pins::GATE_COMPARE_ENABLE;
 }
 
-// Set the given output to low
-inline void GateOutputOff(uint8_t channel) {
-  switch (channel) {
-    case 0: out_1_a.Low();
-            out_1_b.Low();
-            break;
-    case 1: out_2_a.Low();
-            out_2_b.Low();
-            break;
+// End the given channel's output the given number of ticks from now, with the timer
+// compare. Only call with interrupts disabled
+template<uint8_t channel>
+inline void GateScheduleFall(uint16_t delay) {
+  GateCompareSchedule<channel>(delay);
+}
+
+// Cancel the scheduled end of the given channel's output. Only call with interrupts disabled
+template<uint8_t channel>
+inline void GateCancelFall() {
+  TIMSK1 &= ~ChannelPins<channel>::GATE_COMPARE_ENABLE;
+}
+
+inline void GateCancelFall(uint8_t channel) {
+  (channel == 0) ? GateCancelFall<0>() : GateCancelFall<1>();
+}
+
+// Is the end of the given channel's output scheduled with the timer compare?
+template<uint8_t channel>
+inline bool GateFallIsScheduled() {
+  return TIMSK1 & ChannelPins<channel>::GATE_COMPARE_ENABLE;
+}
+
+inline bool GateFallIsScheduled(uint8_t channel) {
+  return (channel == 0) ? GateFallIsScheduled<0>() : GateFallIsScheduled<1>();
+}
+
+// Multiply the given value by the given unsigned Q16 fraction (0 - 0.99998)
+// The 32 bit intermediate can't overflow
+inline uint16_t FixedMultiply(uint16_t value, uint16_t fraction) {
+  return (static_cast<uint32_t>(value) * fraction) >> 16;
+}
+
+// Q16 reciprocals of 2 - 16, rounded down
+#define FIXED_DIVISOR_MIN 2
+#define FIXED_DIVISOR_MAX 16
+const uint16_t lut_reciprocal[] PROGMEM = {
+  32768, 21845, 16384, 13107, 10922, 9362, 8192, 7281,
+  6553, 5957, 5461, 5041, 4681, 4369, 4096
+};
+
+// Divide the given value by the given divisor (2 - 16) using its reciprocal
+// Rounding the reciprocal down leaves the quotient at most one short, so a single
+// correction makes it exact
+inline uint16_t FixedDivide(uint16_t value, uint8_t divisor) {
+  uint16_t quotient = FixedMultiply(value,
+    pgm_read_word(&lut_reciprocal[divisor - FIXED_DIVISOR_MIN]));
+  if (static_cast<uint16_t>(value - quotient * divisor) >= divisor) {
+    ++quotient;
   }
+  return quotient;
 }
 
-// Clear both of the values in the Pulse Tracker
-inline void PulseTrackerClear() {
-  pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 2] = 0;
-  pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1] = 0;
-  pulse_tracker_recorded_count = 0;
+// Clear both of the values in the given channel's Pulse Tracker
+inline void PulseTrackerClear(FunctionState* f) {
+  f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 2] = 0;
+  f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1] = 0;
+  f->pulse_tracker_recorded_count = 0;
+  f->pulse_tracker_is_late = false;
 }
 
-// The amount of time since the last tracked event
-inline uint16_t PulseTrackerGetElapsed() {
-  return (TCNT1 >= pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1])
-    ? TCNT1 - pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1]
-    : TCNT1 + (TCNT1_MAX - pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1]);
+// The amount of time since the given channel's last tracked event
+inline uint16_t PulseTrackerGetElapsed(FunctionState* f) {
+  uint16_t now = ClockNow();
+  return (now >= f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1])
+    ? now - f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1]
+    : now + (TCNT1_MAX - f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1]);
 }
 
-// The period of time between the last two recorded events
-inline uint16_t PulseTrackerGetPeriod() {
-  return (pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1] >= pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 2])
-    ? pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1] - pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 2]
-    : pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1] + (TCNT1_MAX - pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 2]);
+// The period of time between the given channel's last two recorded events
+inline uint16_t PulseTrackerGetPeriod(FunctionState* f) {
+  return (f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1] >= f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 2])
+    ? f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1] - f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 2]
+    : f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1] + (TCNT1_MAX - f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 2]);
 }
 
 // Is the pulse tracker populated with enough events to perform multiply?
-inline bool PulseTrackerHasPeriod(uint8_t channel) {
-  return pulse_tracker_recorded_count >= PULSE_TRACKER_BUFFER_SIZE;
+inline bool PulseTrackerHasPeriod(FunctionState* f) {
+  return f->pulse_tracker_recorded_count >= PULSE_TRACKER_BUFFER_SIZE;
+}
+
+// Has the given channel gone long enough without an input that its clock has stopped?
+// The elapsed time wraps around with the timer, so it's noted once it passes halfway,
+// and a wrap after that times out. The loop checks a channel's first function far more
+// often than half the range, so a clock that's slower than the timeout can allow still
+// stops after 8.4s
+inline bool PulseTrackerIsTimedOut(FunctionState* f) {
+  if (!PulseTrackerHasPeriod(f)) {
+    return false;
+  }
+  uint16_t elapsed = PulseTrackerGetElapsed(f);
+  if (elapsed >= PULSE_TRACKER_LATE_ELAPSED) {
+    f->pulse_tracker_is_late = true;
+  } else if (f->pulse_tracker_is_late) {
+    return true;
+  }
+  uint16_t period = PulseTrackerGetPeriod(f);
+  return period <= TCNT1_MAX / PULSE_TRACKER_TIMEOUT_PERIODS &&
+    elapsed >= period * PULSE_TRACKER_TIMEOUT_PERIODS;
 }
 
-// Record the current time as the latest pulse tracker event and shift the last one back
-void PulseTrackerRecord() {
+// Record the given time as the given channel's latest pulse tracker event and shift the last one back
+void PulseTrackerRecord(FunctionState* f, uint16_t at) {
   // shift
-  pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 2] = pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1];
-  pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1] = TCNT1;
-  if (pulse_tracker_recorded_count < PULSE_TRACKER_BUFFER_SIZE) {
-    pulse_tracker_recorded_count += 1;
+  f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 2] = f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1];
+  f->pulse_tracker_buffer[PULSE_TRACKER_BUFFER_SIZE - 1] = at;
+  f->pulse_tracker_is_late = false;
+  if (f->pulse_tracker_recorded_count < PULSE_TRACKER_BUFFER_SIZE) {
+    f->pulse_tracker_recorded_count += 1;
   }
 }
 
 // Is the factor control setting such that we're in multiplier mode?
-inline bool MultiplyIsEnabled(uint8_t channel) {
-  return factor[channel] < FACTORER_BYPASS_VALUE;
+inline bool MultiplyIsEnabled(FunctionState* f) {
+  return f->factor < FACTORER_BYPASS_VALUE;
 }
 
 // The time interval between multiplied events
 // eg if clock is comes in at 100 and 200, and the clock multiply factor is 2,
 // the result will be 50
-inline uint16_t MultiplyInterval(uint8_t channel) {
-  return PulseTrackerGetPeriod() / -factor[channel];
+inline uint16_t MultiplyInterval(FunctionState* f) {
+  return FixedDivide(PulseTrackerGetPeriod(f), -f->factor);
+}
+
+// The time since the last tracked event at which the given division of the period
+// is due, ie division * period / divisor
+// The remainder of the period division is spread across the divisions, so they
+// land exactly where they should without overflowing 16 bits
+inline uint16_t PulseTrackerDivisionAt(FunctionState* f, uint8_t division, uint8_t divisor) {
+  uint16_t period = PulseTrackerGetPeriod(f);
+  uint16_t interval = FixedDivide(period, divisor);
+  uint8_t remainder = period - interval * divisor;
+  return interval * division + FixedDivide(remainder * division, divisor);
+}
+
+// The time since the last thru at which the given strike is due
+inline uint16_t MultiplyStrikeAt(FunctionState* f, uint8_t strike) {
+  return PulseTrackerDivisionAt(f, strike, -f->factor);
 }
 
 // Should the multiplier function exec on this cycle?
-inline bool MultiplyShouldStrike(uint8_t channel, uint16_t elapsed) {
-  uint16_t interval = MultiplyInterval(channel);
-  if (elapsed % interval <= FUNCTION_TIMING_ERROR_CORRECTION_AMOUNT) {
-    if (!multiply_is_debouncing[channel]) {
-      return true;
-    }
-    // debounce window/return false
-  } else {
-    // debounce is finished
-    multiply_is_debouncing[channel] = false;
-  }
-  return false;
+// At most factor - 1 strikes are emitted between thrus. A strike that is late goes
+// out on the next cycle, and the following one is still timed from the thru. A strike
+// still owed when the next input arrives, eg when the clock speeds up, falls on the
+// thru and isn't emitted separately
+inline bool MultiplyShouldStrike(FunctionState* f, uint16_t elapsed) {
+  return f->multiply_strike_count < -f->factor - 1 &&
+    elapsed >= f->multiply_next_strike_at;
 }
 
 // Is the factor setting such that we're in divider mode?
-inline bool DivideIsEnabled(uint8_t channel) {
-  return factor[channel] > FACTORER_BYPASS_VALUE;
+inline bool DivideIsEnabled(FunctionState* f) {
+  return f->factor > FACTORER_BYPASS_VALUE;
 }
 
 // Should the divider function exec on this cycle?
-inline bool DivideShouldStrike(uint8_t channel) {
-  return divide_counter[channel] <= 0;
+inline bool DivideShouldStrike(FunctionState* f) {
+  return f->divide_counter <= 0;
 }
 
 // What is the current factor setting?
-inline int16_t FactorGet(uint8_t channel) {
-  int16_t factor_index = (adc_value[channel] / (ADC_MAX_VALUE / (FACTORER_NUM_FACTORS - 1))) - FACTORER_BYPASS_INDEX;
+inline int8_t FactorGet(FunctionState* f) {
+  int8_t factor_index = (f->adc_value / (ADC_MAX_VALUE / (FACTORER_NUM_FACTORS - 1))) - FACTORER_BYPASS_INDEX;
   // offset result so that there's no -1 or 0 factors, but values are still evenly spaced
   if (factor_index == 0) {
     return FACTORER_BYPASS_VALUE;
@@ -361,64 +845,36 @@ inline int16_t FactorGet(uint8_t channel) {
   }
 }
 
-// Turn off the LED for the given channel
-inline void LedOff(uint8_t channel) {
-  switch(channel) {
-    case 0: led_1_a.Low();
-            led_1_k.Low();
-            break;
-    case 1: led_2_a.Low();
-            led_2_k.Low();
-            break;
-  }
+// The next pot/CV scan is due
+ISR(TIMER0_COMPA_vect) {
+  adc_is_scan_due = true;
 }
 
-// Make the LED for the given channel green
-inline void LedGreen(uint8_t channel) {
-  switch(channel) {
-    case 0: led_1_a.Low();
-            led_1_k.High();
-            break;
-    case 1: led_2_a.Low();
-            led_2_k.High();
-            break;
-  }
-}
-
-// Make the LED for the given channel red
-inline void LedRed(uint8_t channel) {
-  switch(channel) {
-    case 0: led_1_a.High();
-            led_1_k.Low();
-            break;
-    case 1: led_2_a.High();
-            led_2_k.Low();
-            break;
-  }
-}
-
-// Scan both pots and CV inputs for changes
+// Scan both pots and CV inputs for changes, when a scan is due
+// A scan only happens once the last conversion is done, so it never waits on the adc
 inline void AdcScan() {
-  if (adc_counter == (ADC_POLL_RATIO-1)) {
+  if (!adc_is_scan_due || (ADCSRA & _BV(ADSC))) {
+    adc_counter = 1;
+  } else {
+    adc_is_scan_due = false;
     adc.Scan();
     adc_counter = 0;
-  } else {
-    ++adc_counter;
   }
 }
 
 // Does the pot/CV input for the given channel have a new value since last checked?
 bool AdcHasNewValue(uint8_t channel) {
   if (adc_counter == 0) {
+    FunctionState* f = &function_state[channel];
     int16_t value = AdcReadValue(channel);
     // compare to stored control value
-    int16_t delta = value - adc_value[channel];
+    int16_t delta = value - f->adc_value;
     // abs
     if (delta < 0) {
       delta = -delta;
     }
     if (delta > ADC_DELTA_THRESHOLD) {
-      AdcSetValue(channel, value);
+      AdcSetValue(f, value);
       return true;
     }
   }
@@ -427,121 +883,429 @@ bool AdcHasNewValue(uint8_t channel) {
 
 // Initialize the pulse tracker and other time based variables
 inline void ClockInit() {
-  PulseTrackerClear();
+  for (uint8_t i = 0; i < SYSTEM_NUM_FUNCTION_CHANNELS; ++i) {
+    PulseTrackerClear(&function_state[i]);
+    function_state[i].last_action_at = 0;
+  }
   for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
-    channel_last_action_at[i] = 0;
-    trigger_extend_count[i] = 0;
-    button_last_press_at[i] = 0;
-    button_is_inhibited[i] = false;
+    ChannelState* c = &channel_state[i];
+    c->is_trigger_extended = false;
+    c->button_last_press_at = 0;
+    c->button_is_inhibited = false;
+    c->button_is_tap_valid = false;
   }
 }
 
 // For the given channel, use the LEDs to signify that trig thru is occurring
 // EG in multiplier mode, an output that occurs at the same time as a trig input
-inline void LedExecThru(uint8_t channel) {
-  led_gate_duration[channel] = LED_THRU_GATE_DURATION;
-  led_state[channel] = 1;
+inline void LedExecThru(ChannelState* c) {
+  c->led_gate_duration = LED_THRU_GATE_DURATION;
+  c->led_on_at = ClockNow();
+  c->led_state = 1;
 }
 
 // For the given channel, use the LEDs to signify that a factored output is happening
 // EG in multiplier mode, an output that occurs between trig inputs
-inline void LedExecStrike(uint8_t channel) {
-  led_gate_duration[channel] = LED_FACTORED_GATE_DURATION;
-  led_state[channel] = 2;
+inline void LedExecStrike(ChannelState* c) {
+  c->led_gate_duration = LED_FACTORED_GATE_DURATION;
+  c->led_on_at = ClockNow();
+  c->led_state = 2;
 }
 
 // For the given channel, get the current swing amount value specified by the pot/CV input
-inline int16_t SwingGet(uint8_t channel) {
-  return (adc_value[channel] / (ADC_MAX_VALUE / (SWING_FACTOR_MAX - SWING_FACTOR_MIN))) + SWING_FACTOR_MIN;
+inline uint8_t SwingGet(FunctionState* f) {
+  return (f->adc_value / (ADC_MAX_VALUE / (SWING_FACTOR_MAX - SWING_FACTOR_MIN))) + SWING_FACTOR_MIN;
 }
 
 // Update the LEDs for the given channel based on the current system state
-inline void LedUpdate(uint8_t channel) {
-  //
-  if (led_gate_duration[channel]) {
-    --led_gate_duration[channel];
-    if (!led_gate_duration[channel]) {
-      led_state[channel] = 0;
-    }
+template<uint8_t channel>
+inline void LedUpdate() {
+  ChannelState* c = &channel_state[channel];
+  // the LED is timed rather than counted in loops, since the loop sleeps while idle
+  if (c->led_state &&
+      static_cast<uint16_t>(ClockNow() - c->led_on_at) >= c->led_gate_duration) {
+    c->led_state = 0;
   }
 
   // Update Leds
-  switch (led_state[channel]) {
-    case 0: LedOff(channel);
+  switch (c->led_state) {
+    case 0: ChannelPins<channel>::LedOff();
             break;
-    case 1: LedGreen(channel);
+    case 1: ChannelPins<channel>::LedGreen();
             break;
-    case 2: LedRed(channel);
+    case 2: ChannelPins<channel>::LedRed();
             break;
   }
 }
 
-// Is the gate input for the given channel seeing a new pulse?
-inline bool GateInputIsRisingEdge(uint8_t channel) {
-  bool last_state = gate_input_state[channel];
-  // store current input state
-  gate_input_state[channel] = GateInputRead(channel);
-  //
-  return gate_input_state[channel] && !last_state;
+// The time at which the given gate input's latest pulse started
+inline uint16_t GateInputRisingEdgeAt(uint8_t channel) {
+  uint16_t at;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    at = gate_input[channel].rising_edge_at;
+  }
+  return at;
+}
+
+// Has at least the given number of ticks surely passed between the given times?
+// Either time can be anywhere within its tick, so one more tick has to be counted
+inline bool GateInputHasLasted(uint16_t since, uint16_t now, uint8_t ticks) {
+  return !ticks || static_cast<uint16_t>(now - since) > ticks;
+}
+
+// Has the gate input for the given channel seen a new pulse that hasn't been handled?
+// The pulse only counts once it's been high for the minimum high time
+inline bool GateInputIsRisingEdge(uint8_t channel, uint16_t now) {
+  return gate_input[channel].is_rising_edge &&
+    GateInputHasLasted(GateInputRisingEdgeAt(channel), now, gate_input_min_high_time);
+}
+
+// Mark the given gate input's latest pulse as handled
+inline void GateInputClearRisingEdge(uint8_t channel) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    gate_input[channel].pulse_at = gate_input[channel].rising_edge_at;
+    gate_input[channel].is_rising_edge = false;
+  }
 }
 
 // For the given channel, update state for a multiply strike
-inline void MultiplyExecStrike(uint8_t channel) {
-  channel_last_action_at[channel] = TCNT1;
-  exec_state[channel] = 2;
-  multiply_is_debouncing[channel] = true;
+inline void MultiplyExecStrike(FunctionState* f) {
+  f->last_action_at = ClockNow();
+  f->exec_state = 2;
+  ++f->multiply_strike_count;
+  f->multiply_next_strike_at = MultiplyStrikeAt(f, f->multiply_strike_count + 1);
 }
 
 // For the given channel and current system state, execute a single
 // cycle of the multiplier function
-inline void MultiplyExec(uint8_t channel) {
-  if (MultiplyIsEnabled(channel) &&
-        PulseTrackerHasPeriod(channel) &&
-        MultiplyShouldStrike(channel, PulseTrackerGetElapsed())) {
-    MultiplyExecStrike(channel);
+inline void MultiplyExec(FunctionState* f) {
+  if (MultiplyIsEnabled(f) &&
+        PulseTrackerHasPeriod(f) &&
+        MultiplyShouldStrike(f, PulseTrackerGetElapsed(f))) {
+    MultiplyExecStrike(f);
   }
 }
 
 // For the given channel, reset the divider function
-inline void DivideReset(uint8_t channel) {
-  divide_counter[channel] = 0;
+inline void DivideReset(FunctionState* f) {
+  f->divide_counter = 0;
 }
 
 // For the given channel and current system state, should the divider function reset?
-inline bool DivideShouldReset(uint8_t channel) {
-  return divide_counter[channel] >= (factor[channel] - 1);
+inline bool DivideShouldReset(FunctionState* f) {
+  return f->divide_counter >= (f->factor - 1);
 }
 
 // For the given channel, update state for a divide strike
-inline void DivideExecStrike(uint8_t channel) {
-  channel_last_action_at[channel] = TCNT1;
-  exec_state[channel] = 2; // divide converts thru to exec on every division
+inline void DivideExecStrike(FunctionState* f) {
+  f->last_action_at = ClockNow();
+  f->exec_state = 2; // divide converts thru to exec on every division
+}
+
+// Bring the given channel's strike state in line with a new factor, partway thru a
+// period. Strikes that are already past for the new factor are counted as done, so
+// the next one lands in phase with the input
+inline void MultiplyRephase(FunctionState* f) {
+  if (!MultiplyIsEnabled(f) || !PulseTrackerHasPeriod(f)) {
+    return;
+  }
+  uint16_t elapsed = PulseTrackerGetElapsed(f);
+  uint8_t strike = 0;
+  while (strike < -f->factor - 1 && MultiplyStrikeAt(f, strike + 1) <= elapsed) {
+    ++strike;
+  }
+  f->multiply_strike_count = strike;
+  f->multiply_next_strike_at = MultiplyStrikeAt(f, strike + 1);
 }
 
 // Update the given channel's state to reflect a multiplier thru for this cycle
-inline void MultiplyExecThru(uint8_t channel) {
-  exec_state[channel] = 1;
-  channel_last_action_at[channel] = TCNT1;
+// The thru starts a new period, so the strike count starts over and any strike
+// still owed is dropped in favour of the thru
+inline void MultiplyExecThru(FunctionState* f) {
+  f->exec_state = 1;
+  f->last_action_at = ClockNow();
+  f->multiply_strike_count = 0;
+  if (MultiplyIsEnabled(f) && PulseTrackerHasPeriod(f)) {
+    f->multiply_next_strike_at = MultiplyStrikeAt(f, 1);
+  }
 }
 
 // For the given channel, process a new pulse using the factorer function
-void FactorerHandleInputGateRisingEdge(uint8_t channel) {
+void FactorerHandleInputGateRisingEdge(FunctionState* f) {
   //
-  if (DivideIsEnabled(channel)) {
-    if (DivideShouldStrike(channel)) {
-      DivideExecStrike(channel);
+  if (DivideIsEnabled(f)) {
+    if (DivideShouldStrike(f)) {
+      DivideExecStrike(f);
     }
     // deal with counter
-    if (DivideShouldReset(channel)) {
-      DivideReset(channel);
+    if (DivideShouldReset(f)) {
+      DivideReset(f);
     } else {
-      ++divide_counter[channel];
+      ++f->divide_counter;
     }
   } else {
-    MultiplyExecThru(channel); // mult always acknowledges thru
+    MultiplyExecThru(f); // mult always acknowledges thru
   }
 }
 
+// Is any channel running the audio rate factorer?
+inline bool AudioIsEnabled() {
+  for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
+    if (audio_state[i].factor) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Enable or disable the audio timer interrupts depending on whether any channel
+// is in audio rate mode
+void AudioUpdateInterrupts() {
+  if (AudioIsEnabled()) {
+    TIMSK2 |= _BV(TOIE2);
+  } else {
+    TIMSK2 = 0;
+  }
+}
+
+// Initialize the audio rate timer
+// Timer2 free runs and is extended to 16 bits by its overflow interrupt
+void AudioInit() {
+  TCCR2A = 0;
+  TCCR2B = AUDIO_TIMER_PRESCALER;
+  AudioUpdateInterrupts();
+}
+
+// The current audio timer value. Only call with interrupts disabled
+inline uint16_t AudioClockNow() {
+  uint8_t low = TCNT2;
+  uint8_t high = audio_clock_high;
+  // an overflow that hasn't been serviced yet
+  if ((TIFR2 & _BV(TOV2)) && low < 0x80) {
+    ++high;
+  }
+  return (static_cast<uint16_t>(high) << 8) | low;
+}
+
+// Set the audio rate output for the given channel
+template<uint8_t channel>
+inline void AudioOutputSet(bool state) {
+  audio_state[channel].output_state = state;
+  state ? ChannelPins<channel>::GateOutputOn() : ChannelPins<channel>::GateOutputOff();
+}
+
+// Flip the audio rate output for the given channel
+template<uint8_t channel>
+inline void AudioOutputToggle() {
+  AudioOutputSet<channel>(!audio_state[channel].output_state);
+}
+
+// Load the wait until the next multiplied toggle for the given channel. The remainder
+// of the period division is spread across toggles so the total always adds up to
+// exactly one input period
+inline void AudioLoadInterval(volatile AudioState* a) {
+  a->wait = a->interval;
+  a->interval_error += a->interval_remainder;
+  if (a->interval_error >= a->toggles_per_period) {
+    a->interval_error -= a->toggles_per_period;
+    ++a->wait;
+  }
+}
+
+// Take the next hop of the given channel's wait that fits in the 8 bit compare register
+// Waits between one and two hops long are split evenly, so no hop is too short to schedule
+inline uint8_t AudioNextStep(volatile AudioState* a) {
+  uint16_t wait = a->wait;
+  uint8_t step;
+  if (wait >= 2 * AUDIO_INTERVAL_STEP_MAX) {
+    step = AUDIO_INTERVAL_STEP_MAX;
+  } else if (wait > AUDIO_INTERVAL_STEP_MAX) {
+    step = wait >> 1;
+  } else {
+    step = wait;
+  }
+  a->wait = wait - step;
+  return step;
+}
+
+// Arm the audio timer compare for the given channel at the given time
+template<uint8_t channel>
+inline void AudioCompareSchedule(uint8_t at) {
+  typedef ChannelPins<channel> Pins;
+  Pins::AudioCompare() = at;
+  TIFR2 = Pins::AUDIO_COMPARE_FLAG;
+  TIMSK2 |= Pins::AUDIO_COMPARE_ENABLE;
+}
+
+// For the given channel, start multiplying an input period that began at the given time
+template<uint8_t channel>
+inline void AudioMultiplyStart(uint16_t period, uint16_t now) {
+  volatile AudioState* a = &audio_state[channel];
+  // two toggles per multiplied cycle
+  uint8_t toggles = -a->factor << 1;
+  a->interval = FixedDivide(period, toggles);
+  if (a->interval < AUDIO_INTERVAL_MIN) {
+    // too fast to multiply, so pass thru
+    a->toggles_remaining = 0;
+    return;
+  }
+  a->interval_remainder = period - a->interval * toggles;
+  a->interval_error = 0;
+  a->toggles_per_period = toggles;
+  a->toggles_remaining = toggles - 1;
+  AudioLoadInterval(a);
+  AudioCompareSchedule<channel>(static_cast<uint8_t>(now) + AudioNextStep(a));
+}
+
+// For the given channel, handle the audio timer compare
+// Returns the number of ticks until the next compare, or 0 when the period is done
+template<uint8_t channel>
+inline uint8_t AudioHandleCompare() {
+  volatile AudioState* a = &audio_state[channel];
+  if (!a->toggles_remaining) {
+    return 0;
+  }
+  if (!a->wait) {
+    AudioOutputToggle<channel>();
+    if (!--a->toggles_remaining) {
+      return 0;
+    }
+    AudioLoadInterval(a);
+  }
+  return AudioNextStep(a);
+}
+
+// For the given channel, process a change of the trig input at audio rate
+//
+// Division is done by counting edges, and the output flips every factor edges. Even
+// factors always give an even duty cycle. Odd factors only do for a square input: an
+// input with duty cycle d divided by 3 gives (1 + d) / 3. Multiplication restarts on
+// each rising edge and is driven by the audio timer compare
+template<uint8_t channel>
+inline void AudioFactorerHandleInputEdge(bool state, uint16_t now) {
+  volatile AudioState* a = &audio_state[channel];
+  int8_t channel_factor = a->factor;
+  if (!channel_factor) {
+    // not in audio rate mode
+    return;
+  }
+  if (channel_factor > FACTORER_BYPASS_VALUE) {
+    if (++a->edge_count >= channel_factor) {
+      a->edge_count = 0;
+      AudioOutputToggle<channel>();
+    }
+  } else if (state) {
+    AudioOutputSet<channel>(true);
+    if (channel_factor < FACTORER_BYPASS_VALUE && a->has_period) {
+      AudioMultiplyStart<channel>(now - a->last_rise_at, now);
+    }
+    a->last_rise_at = now;
+    a->has_period = true;
+  } else if (!a->toggles_remaining) {
+    // bypass, or there's no period to multiply yet
+    AudioOutputSet<channel>(false);
+  }
+}
+
+// Reset the audio rate factorer for the given channel
+inline void AudioFactorerReset(uint8_t channel) {
+  audio_state[channel].edge_count = 0;
+  audio_state[channel].has_period = false;
+}
+
+// For the given channel and current system state, execute a single
+// cycle of the audio rate factorer. Outputs are driven by the interrupts, so
+// this only has to show activity on the LED
+inline void AudioFactorerExec(uint8_t channel) {
+  if (audio_state[channel].output_state) {
+    LedExecStrike(&channel_state[channel]);
+  }
+}
+
+// Extend the audio timer to 16 bits
+ISR(TIMER2_OVF_vect) {
+  ++audio_clock_high;
+}
+
+// Process a change of the trig input for every channel in audio rate mode
+inline void AudioHandleInputEdge(bool state) {
+  uint16_t now = AudioClockNow();
+  AudioFactorerHandleInputEdge<0>(state, now);
+  AudioFactorerHandleInputEdge<1>(state, now);
+}
+
+// Gate input change
+// Rising edges are timestamped here, so that they're exact regardless of how long
+// the loop takes. The glitch filter works on these timestamps: a rising edge while a
+// pulse is pending, or too soon after the last pulse, is ignored, and a pulse that
+// falls before the minimum high time is dropped
+// Only an input that appears to have changed is majority sampled, and neither input
+// is while a channel is at audio rate. The sampling waits with interrupts off, which
+// would delay the audio edges and the audio timer's toggles
+template<uint8_t channel>
+inline void GateInputHandleChange(uint16_t now) {
+  volatile GateInputState* g = &gate_input[channel];
+  bool state = ChannelPins<channel>::GateInputRead();
+  if (state != g->state && !AudioIsEnabled()) {
+    state = GateInputReadFiltered<channel>();
+  }
+  if (state != g->state) {
+    g->state = state;
+    if (state) {
+      if (!g->is_rising_edge &&
+          GateInputHasLasted(g->pulse_at, now, gate_input_min_retrigger_time)) {
+        g->rising_edge_at = now;
+        g->is_rising_edge = true;
+      }
+    } else if (g->is_rising_edge &&
+        !GateInputHasLasted(g->rising_edge_at, now, gate_input_min_high_time)) {
+      g->is_rising_edge = false;
+    }
+    if (channel == GATE_INPUT_TRIG_INDEX) {
+      AudioHandleInputEdge(state);
+    }
+  }
+}
+
+ISR(PCINT2_vect) {
+  uint16_t now = TCNT1;
+  GateInputHandleChange<0>(now);
+  GateInputHandleChange<1>(now);
+}
+
+// Handle the audio timer compare for the given channel
+template<uint8_t channel>
+inline void AudioCompareHandle() {
+  uint8_t step = AudioHandleCompare<channel>();
+  if (step) {
+    ChannelPins<channel>::AudioCompare() += step;
+  } else {
+    TIMSK2 &= ~ChannelPins<channel>::AUDIO_COMPARE_ENABLE;
+  }
+}
+
+// Multiplied toggles for channel 1
+ISR(TIMER2_COMPA_vect) {
+  AudioCompareHandle<0>();
+}
+
+// Multiplied toggles for channel 2
+ISR(TIMER2_COMPB_vect) {
+  AudioCompareHandle<1>();
+}
+
+// Swing delay as a Q16 fraction of the period, (2 * swing - 100) / 100, for each
+// swing amount from SWING_FACTOR_MIN up to 99
+const uint16_t lut_swing_ratio[] PROGMEM = {
+  0, 1311, 2621, 3932, 5243, 6554, 7864, 9175,
+  10486, 11796, 13107, 14418, 15729, 17039, 18350, 19661,
+  20972, 22282, 23593, 24904, 26214, 27525, 28836, 30147,
+  31457, 32768, 34079, 35389, 36700, 38011, 39322, 40632,
+  41943, 43254, 44564, 45875, 47186, 48497, 49807, 51118,
+  52429, 53740, 55050, 56361, 57672, 58982, 60293, 61604,
+  62915, 64225
+};
+
 // For the given channel, pulses stored in the pulse tracker, and the factor setting
 // of the swing function, what is the time interval that the swung output will be delayed
 // passed the corresponding input gate?
@@ -551,16 +1315,18 @@ void FactorerHandleInputGateRisingEdge(uint8_t channel) {
 //
 // [input pulse1/swing thru].......[input pulse2]....[swing strike]..........
 //
-inline uint16_t SwingInterval(uint8_t channel) {
-  uint16_t period = PulseTrackerGetPeriod();
-  return ((10 * (period * 2)) / (1000 / swing[channel])) - period;
+inline uint16_t SwingInterval(FunctionState* f) {
+  // the swung pulse lands at swing percent of two periods, so it's delayed by
+  // (2 * swing - 100) percent of one period past the input
+  return FixedMultiply(PulseTrackerGetPeriod(f),
+    pgm_read_word(&lut_swing_ratio[f->swing - SWING_FACTOR_MIN]));
 }
 
 // For the given amount of time since the last swing strike/thru, should the swing function
 // on the given channel exec during this cycle?
-inline bool SwingShouldStrike(uint8_t channel, uint16_t elapsed) {
-  if (swing_counter[channel] >= 2 && swing[channel] > SWING_FACTOR_MIN) {
-    uint16_t interval = SwingInterval(channel);
+inline bool SwingShouldStrike(FunctionState* f, uint16_t elapsed) {
+  if (f->swing_counter >= 2 && f->swing > SWING_FACTOR_MIN) {
+    uint16_t interval = SwingInterval(f);
     return (elapsed >= interval &&
       elapsed <= interval + FUNCTION_TIMING_ERROR_CORRECTION_AMOUNT);
   } else {
@@ -570,128 +1336,642 @@ inline bool SwingShouldStrike(uint8_t channel, uint16_t elapsed) {
 }
 
 // Reset the swing function for the given channel
-inline void SwingReset(uint8_t channel) {
-  swing_counter[channel] = 0;
+inline void SwingReset(FunctionState* f) {
+  f->swing_counter = 0;
 }
 
 // Update the given channel's state to reflect a swing thru execution for this cycle
-inline void SwingExecThru(uint8_t channel) {
-  exec_state[channel] = 1;
-  channel_last_action_at[channel] = TCNT1;
+inline void SwingExecThru(FunctionState* f) {
+  f->exec_state = 1;
+  f->last_action_at = ClockNow();
 }
 
 // Update the given channel's state to reflect a swing strike execution for this cycle
-inline void SwingExecStrike(uint8_t channel) {
-  exec_state[channel] = 2;
-  channel_last_action_at[channel] = TCNT1;
+inline void SwingExecStrike(FunctionState* f) {
+  f->exec_state = 2;
+  f->last_action_at = ClockNow();
 }
 
 // For the given channel, process a new pulse using the swing function
-void SwingHandleInputGateRisingEdge(uint8_t channel) {
-  switch (swing_counter[channel]) {
+void SwingHandleInputGateRisingEdge(FunctionState* f) {
+  switch (f->swing_counter) {
     case 0: // thru beat
-            SwingExecThru(channel);
-            swing_counter[channel] = 1;
+            SwingExecThru(f);
+            f->swing_counter = 1;
             break;
     case 1: // skipped thru beat
             // unless lowest setting, no swing - should do thru
-            if (swing[channel] <= SWING_FACTOR_MIN) {
-              SwingExecStrike(channel);
-              SwingReset(channel);
+            if (f->swing <= SWING_FACTOR_MIN) {
+              SwingExecStrike(f);
+              SwingReset(f);
             } else {
               // rest
-              exec_state[channel] = 0;
-              swing_counter[channel] = 2;
+              f->exec_state = 0;
+              f->swing_counter = 2;
             }
             break;
-    default: SwingReset(channel); // something is wrong if we're here so reset
+    default: SwingReset(f); // something is wrong if we're here so reset
              break;
   }
 }
 
 // For the given channel and current system state, execute a single
 // cycle of the swing function
-inline void SwingExec(uint8_t channel) {
-  if (SwingShouldStrike(channel, PulseTrackerGetElapsed())) {
-    SwingExecStrike(channel);
-    SwingReset(channel); // reset
+inline void SwingExec(FunctionState* f) {
+  if (SwingShouldStrike(f, PulseTrackerGetElapsed(f))) {
+    SwingExecStrike(f);
+    SwingReset(f); // reset
   }
 }
 
+// For the given channel, get the current probability in percent specified by the pot/CV input
+inline uint8_t ProbabilityGet(FunctionState* f) {
+  return (f->adc_value * PROBABILITY_MAX) / ADC_MAX_VALUE;
+}
+
+// The next value from a 16 bit xorshift generator
+inline uint16_t RandomNext() {
+  random_state ^= random_state << 7;
+  random_state ^= random_state >> 9;
+  random_state ^= random_state << 8;
+  return random_state;
+}
+
+// For the given channel, process a new pulse using the probability function
+// The pulse passes thru with the probability set by the pot/CV input
+inline void ProbabilityHandleInputGateRisingEdge(FunctionState* f) {
+  if (RandomNext() % PROBABILITY_MAX < f->probability) {
+    f->exec_state = 1;
+    f->last_action_at = ClockNow();
+  }
+}
+
+// The looper state of the given channel's function. Loopers only run on physical channels
+inline LooperState* LooperStateGet(FunctionState* f) {
+  return &looper_state[f - function_state];
+}
+
+// For the given channel, get the loop length in steps, less one, specified by the pot/CV input
+inline uint8_t LooperLengthMaskGet(FunctionState* f) {
+  uint8_t length_index = f->adc_value / (ADC_MAX_VALUE / (LOOPER_NUM_LENGTHS - 1));
+  return (LOOPER_STEPS_PER_BEAT << length_index) - 1;
+}
+
+// Does the given step of the pattern have a hit?
+inline bool LooperStepIsSet(LooperState* l, uint8_t step) {
+  return l->pattern[step >> 3] & _BV(step & 7);
+}
+
+// Put a hit at the given step of the pattern
+inline void LooperStepSet(LooperState* l, uint8_t step) {
+  l->pattern[step >> 3] |= _BV(step & 7);
+}
+
+// For the given channel, play the current step of the pattern
+inline void LooperExecStep(FunctionState* f, LooperState* l) {
+  if (LooperStepIsSet(l, (l->beat_step + l->sub_step) & l->length_mask)) {
+    f->exec_state = 2;
+    f->last_action_at = ClockNow();
+  }
+}
+
+// For the given channel, move on to the next step within the input period
+inline void LooperNextStep(FunctionState* f, LooperState* l) {
+  ++l->sub_step;
+  l->step_at = l->next_step_at;
+  l->next_step_at = PulseTrackerDivisionAt(f, l->sub_step + 1, LOOPER_STEPS_PER_BEAT);
+}
+
+// For the given channel, process a new pulse using the looper function
+// Each pulse starts the next group of steps, which keeps the loop locked to the clock
+void LooperHandleInputGateRisingEdge(FunctionState* f) {
+  LooperState* l = LooperStateGet(f);
+  if (l->is_armed) {
+    // recording starts over from an empty pattern
+    for (uint8_t i = 0; i < LOOPER_PATTERN_SIZE; ++i) {
+      l->pattern[i] = 0;
+    }
+    l->is_armed = false;
+    l->is_recording = true;
+    l->is_at_start = true;
+  }
+  l->beat_step = l->is_at_start ? 0 : (l->beat_step + LOOPER_STEPS_PER_BEAT) & l->length_mask;
+  l->is_at_start = false;
+  l->sub_step = 0;
+  l->step_at = 0;
+  if (PulseTrackerHasPeriod(f)) {
+    l->next_step_at = PulseTrackerDivisionAt(f, 1, LOOPER_STEPS_PER_BEAT);
+  }
+  LooperExecStep(f, l);
+}
+
+// For the given channel and current system state, execute a single
+// cycle of the looper function
+inline void LooperExec(FunctionState* f) {
+  LooperState* l = LooperStateGet(f);
+  if (l->sub_step < LOOPER_STEPS_PER_BEAT - 1 &&
+        PulseTrackerHasPeriod(f) &&
+        PulseTrackerGetElapsed(f) >= l->next_step_at) {
+    LooperNextStep(f, l);
+    LooperExecStep(f, l);
+  }
+}
+
+// Reset the looper function for the given channel
+inline void LooperReset(LooperState* l) {
+  l->is_at_start = true;
+}
+
+// Is the given channel recording a pattern?
+inline bool LooperIsRecording(uint8_t channel) {
+  return function_state[channel].function == CHANNEL_FUNCTION_LOOPER &&
+    looper_state[channel].is_recording;
+}
+
+// For the given channel, record a hit at the nearest step
+// A hit nearer the coming step is played when that step comes, otherwise it's played now
+void LooperRecordHit(uint8_t channel) {
+  FunctionState* f = &function_state[channel];
+  LooperState* l = &looper_state[channel];
+  uint8_t step = l->beat_step + l->sub_step;
+  if (PulseTrackerHasPeriod(f) &&
+      PulseTrackerGetElapsed(f) - l->step_at > (l->next_step_at - l->step_at) >> 1) {
+    ++step;
+  } else {
+    f->exec_state = 2;
+    f->last_action_at = ClockNow();
+  }
+  LooperStepSet(l, step & l->length_mask);
+}
+
+// Stop arming or recording on the given channel. A recorded pattern is queued to
+// be saved
+void LooperStop(LooperState* l) {
+  if (l->is_recording) {
+    l->save_remaining = LOOPER_PATTERN_SIZE;
+  }
+  l->is_armed = false;
+  l->is_recording = false;
+}
+
+// For the given channel, arm recording to start with the next pulse, or stop recording
+void LooperToggleRecording(uint8_t channel) {
+  LooperState* l = &looper_state[channel];
+  if (l->is_armed || l->is_recording) {
+    LooperStop(l);
+  } else {
+    l->is_armed = true;
+  }
+}
+
+// Save a byte of a queued pattern to the eeprom, when the eeprom is free
+// A byte at a time is written so that the loop never waits on the eeprom
+void LooperSaveExec() {
+  for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
+    LooperState* l = &looper_state[i];
+    if (l->save_remaining) {
+      if (eeprom_is_ready()) {
+        uint8_t index = LOOPER_PATTERN_SIZE - l->save_remaining;
+        eeprom_update_byte((uint8_t*) (EEPROM_ADDRESS_LOOPER_PATTERN + i * LOOPER_PATTERN_SIZE + index),
+          ~l->pattern[index]);
+        --l->save_remaining;
+      }
+      return;
+    }
+  }
+}
+
+// For the given channel, get the internal clock period specified by the pot/CV input
+inline uint16_t InternalClockPeriodGet(FunctionState* f) {
+  // only runs when the control moves
+  return INTERNAL_CLOCK_TICKS_PER_MINUTE / (INTERNAL_CLOCK_BPM_MIN + f->adc_value);
+}
+
+// The given compare time, or the next timer tick if that time has already passed
+// The compare would only match a time in the past after the timer wraps, 8.4s later
+// Only call with interrupts disabled
+inline uint16_t InternalClockCompareNotBefore(uint16_t at) {
+  uint16_t now = TCNT1;
+  return (static_cast<int16_t>(at - now) > 0) ? at : now + 1;
+}
+
+// Move the given channel's next internal clock tick to one period after the last one
+// Only call with interrupts disabled, while the output is low
+template<uint8_t channel>
+inline void InternalClockReschedule() {
+  volatile InternalClockState* ic = &internal_clock[channel];
+  ChannelPins<channel>::GateCompare() = InternalClockCompareNotBefore(ic->rise_at + ic->period);
+}
+
+// Set the internal clock period for the given channel
+// A tick that's waiting for the old period is moved to the new one
+inline void InternalClockSetPeriod(uint8_t channel, uint16_t period) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    volatile InternalClockState* ic = &internal_clock[channel];
+    ic->period = period;
+    if (!ic->is_high && GateFallIsScheduled(channel)) {
+      (channel == 0) ? InternalClockReschedule<0>() : InternalClockReschedule<1>();
+    }
+  }
+}
+
+// Schedule the given channel's next internal clock tick the given number of ticks from now
+// The timer is shared with the rest of the system, so ticks are scheduled with the
+// compare register rather than by clearing the timer
+void InternalClockSchedule(uint8_t channel, uint16_t delay) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    internal_clock[channel].is_high = false;
+    (channel == 0) ? GateCompareSchedule<0>(delay) : GateCompareSchedule<1>(delay);
+  }
+}
+
+// Start or stop the given channel's internal clock, depending on its function
+// A clock that starts ticks right away
+void InternalClockUpdateInterrupts(uint8_t channel) {
+  if (function_state[channel].function == CHANNEL_FUNCTION_INTERNAL_CLOCK) {
+    InternalClockSchedule(channel, 1);
+  } else {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      GateCancelFall(channel);
+      internal_clock[channel].is_pending = false;
+    }
+  }
+}
+
+// For the given channel, handle a tap of the button that came the given time after
+// the last one. The tap sets the tempo and the clock ticks with it
+inline void InternalClockHandleTap(uint8_t channel, uint16_t interval) {
+  if (interval >= INTERNAL_CLOCK_TAP_INTERVAL_MIN && interval <= INTERNAL_CLOCK_TAP_INTERVAL_MAX) {
+    InternalClockSetPeriod(channel, interval);
+    InternalClockSchedule(channel, 1);
+  }
+}
+
+// Take each channel's internal clock tick that has come since the last cycle
+inline void InternalClockScan() {
+  for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
+    volatile InternalClockState* ic = &internal_clock[i];
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      ic->is_tick = ic->is_pending;
+      ic->tick_at = ic->pending_at;
+      ic->is_pending = false;
+    }
+  }
+}
+
+// The time that the given channel's output stays high for the given interval
+// between outputs, or 0 for a trigger
+inline uint16_t GateLengthGet(uint8_t channel, uint16_t interval) {
+  uint16_t fraction = channel_state[channel].gate_length_fraction;
+  if (!fraction || !interval) {
+    return 0;
+  }
+  uint16_t gate_length = FixedMultiply(interval, fraction);
+  return gate_length ? gate_length : 1;
+}
+
+// For the given channel, handle the internal clock compare at the given time
+// The output is raised at each tick and ended by the following compare, so that
+// both edges are as exact as the timer
+// Returns the time of the next compare
+template<uint8_t channel>
+inline uint16_t InternalClockHandleCompare(uint16_t at) {
+  volatile InternalClockState* ic = &internal_clock[channel];
+  if (ic->is_high) {
+    ChannelPins<channel>::GateOutputOff();
+    ic->is_high = false;
+    // a period that was shortened since the tick may already be over
+    return InternalClockCompareNotBefore(ic->rise_at + ic->period);
+  }
+  ChannelPins<channel>::GateOutputOn();
+  ic->is_high = true;
+  ic->rise_at = at;
+  ic->pending_at = at;
+  ic->is_pending = true;
+  uint16_t gate_length = GateLengthGet(channel, ic->period);
+  return InternalClockCompareNotBefore(at + (gate_length ? gate_length : GATE_TRIGGER_LENGTH));
+}
+
+// Handle the given channel's timer compare, which is either the internal clock
+// or the end of a gate
+template<uint8_t channel>
+inline void GateHandleCompare() {
+  if (function_state[channel].function == CHANNEL_FUNCTION_INTERNAL_CLOCK) {
+    volatile uint16_t& compare = ChannelPins<channel>::GateCompare();
+    compare = InternalClockHandleCompare<channel>(compare);
+  } else {
+    ChannelPins<channel>::GateOutputOff();
+    GateCancelFall<channel>();
+  }
+}
+
+// Timer compare for channel 1
+ISR(TIMER1_COMPA_vect) {
+  GateHandleCompare<0>();
+}
+
+// Timer compare for channel 2
+ISR(TIMER1_COMPB_vect) {
+  GateHandleCompare<1>();
+}
+
 // For the given channel, handle a new value at the pot/CV input
 inline void FunctionHandleNewAdcValue(uint8_t channel) {
-  switch(channel_function_[channel]) {
-    case CHANNEL_FUNCTION_FACTORER: factor[channel] = FactorGet(channel);
+  FunctionState* f = &function_state[channel];
+  int8_t factor;
+  switch(f->function) {
+    case CHANNEL_FUNCTION_FACTORER: factor = FactorGet(f);
+                                    if (factor != f->factor) {
+                                      f->factor = factor;
+                                      MultiplyRephase(f);
+                                    }
                                     break;
-    case CHANNEL_FUNCTION_SWING: swing[channel] = SwingGet(channel);
+    case CHANNEL_FUNCTION_SWING: f->swing = SwingGet(f);
                                  break;
+    case CHANNEL_FUNCTION_AUDIO_FACTORER: f->factor = FactorGet(f);
+                                          audio_state[channel].factor = f->factor;
+                                          break;
+    case CHANNEL_FUNCTION_PROBABILITY: f->probability = ProbabilityGet(f);
+                                       break;
+    case CHANNEL_FUNCTION_LOOPER: looper_state[channel].length_mask = LooperLengthMaskGet(f);
+                                  break;
+    case CHANNEL_FUNCTION_INTERNAL_CLOCK: InternalClockSetPeriod(channel, InternalClockPeriodGet(f));
+                                          break;
   }
 }
 
+void FunctionReset(uint8_t channel);
+
+// Forget the given (possibly virtual) channel's tempo and start its function over
+inline void FunctionStartOver(FunctionState* f) {
+  PulseTrackerClear(f);
+  FunctionReset(f - function_state);
+}
+
+// When the clock stops, the old tempo is forgotten and the function starts over,
+// so that the first input after a restart is the downbeat and the second one
+// gives the new period
+// Returns whether the given function's clock had stopped
+inline bool FunctionTimeoutExec(FunctionState* f) {
+  if (!PulseTrackerIsTimedOut(f)) {
+    return false;
+  }
+  FunctionStartOver(f);
+  return true;
+}
+
+// Does the given (possibly virtual) channel's function have an output due at a later time?
+// Those are timed by the loop, so a running multiplier, swing or looper keeps the cpu awake
+inline bool FunctionIsScheduled(FunctionState* f) {
+  switch(f->function) {
+    case CHANNEL_FUNCTION_FACTORER: return MultiplyIsEnabled(f) &&
+                                      PulseTrackerHasPeriod(f) &&
+                                      f->multiply_strike_count < -f->factor - 1;
+    case CHANNEL_FUNCTION_SWING: return f->swing_counter >= 2 && f->swing > SWING_FACTOR_MIN;
+    case CHANNEL_FUNCTION_LOOPER: return PulseTrackerHasPeriod(f) &&
+                                    LooperStateGet(f)->sub_step < LOOPER_STEPS_PER_BEAT - 1;
+  }
+  return false;
+}
+
 // For the given channel's function, execute a single cycle
-inline void FunctionExec(uint8_t channel) {
-  switch(channel_function_[channel]) {
-    case CHANNEL_FUNCTION_FACTORER: MultiplyExec(channel);
+// Returns the exec state that the function arrived at on this cycle
+inline uint8_t FunctionExec(FunctionState* f) {
+  switch(f->function) {
+    case CHANNEL_FUNCTION_FACTORER: MultiplyExec(f);
                                     break;
-    case CHANNEL_FUNCTION_SWING: SwingExec(channel);
+    case CHANNEL_FUNCTION_SWING: SwingExec(f);
                                  break;
+    case CHANNEL_FUNCTION_LOOPER: LooperExec(f);
+                                  break;
   }
+  uint8_t state = f->exec_state;
+  f->exec_state = 0; // clean up
+  return state;
+}
 
-  // Do stuff
-  if (exec_state[channel] > 0) {
-    GateOutputOn(channel);
-    trigger_extend_count[channel] = TRIGGER_EXTEND_COUNT;
-    (exec_state[channel] < 2) ? LedExecThru(channel) : LedExecStrike(channel);
-  } else {
-    if (trigger_extend_count[channel] <= 0) {
-      GateOutputOff(channel);
-    } else {
-      trigger_extend_count[channel] -= 1;
+// The expected time between the outputs of the given channel's function, or 0 when
+// it isn't known yet
+inline uint16_t FunctionOutputInterval(FunctionState* f) {
+  if (!PulseTrackerHasPeriod(f)) {
+    return 0;
+  }
+  uint16_t period = PulseTrackerGetPeriod(f);
+  switch(f->function) {
+    case CHANNEL_FUNCTION_FACTORER: if (MultiplyIsEnabled(f)) {
+                                      return MultiplyInterval(f);
+                                    } else if (DivideIsEnabled(f)) {
+                                      uint32_t interval = static_cast<uint32_t>(period) * f->factor;
+                                      return (interval > TCNT1_MAX) ? TCNT1_MAX : interval;
+                                    }
+                                    break;
+    case CHANNEL_FUNCTION_LOOPER: return FixedDivide(period, LOOPER_STEPS_PER_BEAT);
+  }
+  return period;
+}
+
+// Drive the given channel's output and LED from the given exec state
+// With a gate length set, the output is ended by the timer compare after that
+// percentage of the output interval of the given stage, which is only worked out
+// for an output
+template<uint8_t channel>
+inline void ChannelOutputExec(uint8_t state, FunctionState* stage) {
+  ChannelState* c = &channel_state[channel];
+  if (state > 0) {
+    uint16_t gate_length = c->gate_length_fraction
+      ? GateLengthGet(channel, FunctionOutputInterval(stage))
+      : 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      ChannelPins<channel>::GateOutputOn();
+      gate_length ? GateScheduleFall<channel>(gate_length) : GateCancelFall<channel>();
+    }
+    c->trigger_at = ClockNow();
+    c->is_trigger_extended = true;
+    (state < 2) ? LedExecThru(c) : LedExecStrike(c);
+  } else if (!GateFallIsScheduled<channel>()) {
+    if (!c->is_trigger_extended ||
+        static_cast<uint16_t>(ClockNow() - c->trigger_at) >= TRIGGER_EXTEND_DURATION) {
+      ChannelPins<channel>::GateOutputOff();
+      c->is_trigger_extended = false;
     }
   }
-  exec_state[channel] = 0; // clean up
 }
 
 // Reset the given channel's function
 inline void FunctionReset(uint8_t channel) {
-  switch(channel_function_[channel]) {
-    case CHANNEL_FUNCTION_FACTORER: DivideReset(channel);
+  FunctionState* f = &function_state[channel];
+  switch(f->function) {
+    case CHANNEL_FUNCTION_FACTORER: DivideReset(f);
+                                    MultiplyRephase(f);
                                     break;
-    case CHANNEL_FUNCTION_SWING: SwingReset(channel);
+    case CHANNEL_FUNCTION_SWING: SwingReset(f);
                                  break;
+    case CHANNEL_FUNCTION_AUDIO_FACTORER: AudioFactorerReset(channel);
+                                          break;
+    case CHANNEL_FUNCTION_LOOPER: LooperReset(&looper_state[channel]);
+                                  break;
+    case CHANNEL_FUNCTION_INTERNAL_CLOCK: InternalClockSchedule(channel, 1);
+                                          break;
   }
 }
 
 // For the given channel's function, handle a new input gate
-inline void FunctionHandleInputGateRisingEdge(uint8_t channel) {
-  switch(channel_function_[channel]) {
-    case CHANNEL_FUNCTION_FACTORER: FactorerHandleInputGateRisingEdge(channel);
+inline void FunctionHandleInputGateRisingEdge(FunctionState* f) {
+  switch(f->function) {
+    case CHANNEL_FUNCTION_FACTORER: FactorerHandleInputGateRisingEdge(f);
                                     break;
-    case CHANNEL_FUNCTION_SWING: SwingHandleInputGateRisingEdge(channel);
+    case CHANNEL_FUNCTION_SWING: SwingHandleInputGateRisingEdge(f);
                                     break;
+    case CHANNEL_FUNCTION_PROBABILITY: ProbabilityHandleInputGateRisingEdge(f);
+                                       break;
+    case CHANNEL_FUNCTION_LOOPER: LooperHandleInputGateRisingEdge(f);
+                                  break;
   }
 }
 
+// For the given (possibly virtual) channel, handle a new input event that happened
+// at the given time
+inline void FunctionHandleInputEvent(FunctionState* f, uint16_t at) {
+  // Pulse tracker is always recording. this should help smooth transitions
+  // between functions even though divide doesn't use it
+  PulseTrackerRecord(f, at);
+  FunctionHandleInputGateRisingEdge(f);
+}
+
+// Reset every stage of the given channel's pipeline
+inline void PipelineReset(uint8_t channel) {
+  FunctionReset(channel);
+  for (uint8_t i = 0; i < pipeline_num_stages[channel]; ++i) {
+    FunctionReset(pipeline_first_stage[channel] + i);
+  }
+}
+
+// The function state of the last stage of the given channel's pipeline
+inline FunctionState* PipelineLastStage(uint8_t channel) {
+  return pipeline_num_stages[channel]
+    ? &function_state[pipeline_first_stage[channel] + pipeline_num_stages[channel] - 1]
+    : &function_state[channel];
+}
+
+// Run the events of the given channel's first function thru the rest of its pipeline
+// Each stage consumes the event of the stage before it within the same pass
+// A stage only runs when it gets an event or has an output due, so an idle pipeline
+// costs a check per stage. The stages only see their inputs stop at their next event,
+// so they start over with the first function when the channel's clock stops
+// Returns the exec state of the last stage
+inline uint8_t PipelineExec(uint8_t channel) {
+  FunctionState* f = &function_state[channel];
+  bool is_timed_out = FunctionTimeoutExec(f);
+  uint8_t state = FunctionExec(f);
+  FunctionState* stage = &function_state[pipeline_first_stage[channel]];
+  for (uint8_t i = 0; i < pipeline_num_stages[channel]; ++i, ++stage) {
+    if (is_timed_out) {
+      FunctionStartOver(stage);
+    }
+    if (state > 0) {
+      FunctionTimeoutExec(stage);
+      FunctionHandleInputEvent(stage, ClockNow());
+    } else if (!FunctionIsScheduled(stage)) {
+      continue;
+    }
+    state = FunctionExec(stage);
+  }
+  return state;
+}
+
 // Based on the given channel's state, execute a single system cycle
-inline void ChannelExec(uint8_t channel) {
+// Returns whether the channel emitted an output event on this cycle
+template<uint8_t channel>
+inline bool ChannelExec() {
   // do stuff
-  FunctionExec(channel);
-  LedUpdate(channel);
+  bool is_event = false;
+  if (function_state[channel].function == CHANNEL_FUNCTION_AUDIO_FACTORER) {
+    // outputs are driven by the interrupts
+    AudioFactorerExec(channel);
+  } else if (function_state[channel].function == CHANNEL_FUNCTION_INTERNAL_CLOCK) {
+    // the output is driven by the interrupt
+    is_event = internal_clock[channel].is_tick;
+    if (is_event) {
+      LedExecThru(&channel_state[channel]);
+    }
+  } else {
+    uint8_t state = PipelineExec(channel);
+    ChannelOutputExec<channel>(state, PipelineLastStage(channel));
+    is_event = state > 0;
+  }
+  LedUpdate<channel>();
+  return is_event;
+}
+
+// Set the given channel's gate length from the pot/CV input. The button is being held,
+// so the press is taken over by the edit: it's no longer a reset, tap or long press
+inline void GateLengthEdit(uint8_t channel) {
+  ChannelState* c = &channel_state[channel];
+  c->button_is_inhibited = true;
+  c->button_is_tap_valid = false;
+  c->is_gate_length_edited = true;
+  GateLengthSet(channel, (function_state[channel].adc_value * GATE_LENGTH_MAX) / ADC_MAX_VALUE);
+}
+
+// Are new control values for the given channel held until the next input?
+inline bool FunctionIsPhaseContinuous(uint8_t channel) {
+  ChannelFunction function = function_state[channel].function;
+  return function_is_phase_continuous &&
+    (function == CHANNEL_FUNCTION_FACTORER || function == CHANNEL_FUNCTION_SWING);
+}
+
+// Apply the given channel's held control value, if any
+// The divider count is carried over to the new factor, so that the next strike is
+// at most one new division away. Moving over from multiply starts a division
+inline void FunctionApplyPendingValue(uint8_t channel) {
+  FunctionState* f = &function_state[channel];
+  if (f->is_value_pending) {
+    f->is_value_pending = false;
+    bool was_dividing = DivideIsEnabled(f);
+    FunctionHandleNewAdcValue(channel);
+    if (f->function == CHANNEL_FUNCTION_FACTORER && DivideIsEnabled(f)) {
+      f->divide_counter = was_dividing ? f->divide_counter % f->factor : 0;
+    }
+  }
 }
 
 // Update the given channel's state according to the system input state
-inline void ChannelStateUpdate(uint8_t channel, bool is_trig, bool is_reset) {
+// When the trig and reset coincide, the given order decides which is handled first
+// While the channel's looper is recording, resets are the hits that it records
+inline void ChannelStateUpdate(uint8_t channel, bool is_trig, uint16_t trig_at,
+                               bool is_reset, bool is_reset_first) {
   // Update for pot/cv in
   if (AdcHasNewValue(channel)) {
-    FunctionHandleNewAdcValue(channel);
+    if (channel_state[channel].button_state) {
+      GateLengthEdit(channel);
+    } else if (FunctionIsPhaseContinuous(channel)) {
+      function_state[channel].is_value_pending = true;
+    } else {
+      FunctionHandleNewAdcValue(channel);
+    }
+  }
+  if (is_trig || is_reset) {
+    FunctionApplyPendingValue(channel);
+  }
+  bool is_record = is_reset && LooperIsRecording(channel);
+  if (is_record) {
+    is_reset = false;
+  }
+  // Update for reset that came first
+  if (is_reset && is_reset_first) {
+    PipelineReset(channel);
   }
   // Update for clock/trig/gate input
   if (is_trig) {
-    FunctionHandleInputGateRisingEdge(channel);
+    FunctionHandleInputEvent(&function_state[channel], trig_at);
   }
   // Update for reset
-  if (is_reset) {
-    FunctionReset(channel);
+  if (is_reset && !is_reset_first) {
+    PipelineReset(channel);
+  }
+  // Update for recorded hit
+  if (is_record) {
+    LooperRecordHit(channel);
   }
 }
 
@@ -702,38 +1982,77 @@ void SystemStateSave() {
   // byte values 1 2 4 8
   for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
     uint8_t b = (i+1) * (i+1);
-    switch(channel_function_[i]) {
+    switch(function_state[i].function) {
       case CHANNEL_FUNCTION_FACTORER: configuration_byte |= b;
                                       break;
       case CHANNEL_FUNCTION_SWING: configuration_byte |= (b * 2);
                                    break;
     }
+    eeprom_write_byte((uint8_t*) (EEPROM_ADDRESS_CHANNEL_FUNCTION + i), ~(function_state[i].function + 1));
   }
-  eeprom_write_byte((uint8_t*) 0, ~configuration_byte);
+  eeprom_write_byte((uint8_t*) EEPROM_ADDRESS_CONFIGURATION, ~configuration_byte);
+  eeprom_write_byte((uint8_t*) EEPROM_ADDRESS_CHANNEL_ROUTING, ~channel_routing);
 }
 
 // Toggle the function for the given channel
 void ChannelFunctionToggle(uint8_t channel) {
-  switch(channel_function_[channel]) {
-    case CHANNEL_FUNCTION_FACTORER: channel_function_[channel] = CHANNEL_FUNCTION_SWING;
+  FunctionState* f = &function_state[channel];
+  audio_state[channel].factor = 0;
+  LooperStop(&looper_state[channel]);
+  channel_state[channel].button_is_tap_valid = false;
+  switch(f->function) {
+    case CHANNEL_FUNCTION_FACTORER: f->function = CHANNEL_FUNCTION_SWING;
                                     break;
-    case CHANNEL_FUNCTION_SWING: channel_function_[channel] = CHANNEL_FUNCTION_FACTORER;
+    case CHANNEL_FUNCTION_SWING: f->function = CHANNEL_FUNCTION_PROBABILITY;
                                  break;
+    case CHANNEL_FUNCTION_PROBABILITY: f->function = CHANNEL_FUNCTION_LOOPER;
+                                       break;
+    case CHANNEL_FUNCTION_LOOPER: f->function = CHANNEL_FUNCTION_INTERNAL_CLOCK;
+                                  break;
+    case CHANNEL_FUNCTION_INTERNAL_CLOCK: f->function = CHANNEL_FUNCTION_AUDIO_FACTORER;
+                                          break;
+    case CHANNEL_FUNCTION_AUDIO_FACTORER: f->function = CHANNEL_FUNCTION_FACTORER;
+                                          break;
   }
+  f->is_value_pending = false;
+  FunctionHandleNewAdcValue(channel);
   FunctionReset(channel);
+  AudioUpdateInterrupts();
+  InternalClockUpdateInterrupts(channel);
+}
+
+// Toggle whether the second channel follows the trig input or the output of the first
+void ChannelRoutingToggle() {
+  channel_routing = (channel_routing == CHANNEL_ROUTING_CHAINED)
+    ? CHANNEL_ROUTING_PARALLEL
+    : CHANNEL_ROUTING_CHAINED;
+  PulseTrackerClear(&function_state[1]);
+  PipelineReset(1);
+}
+
+// Are both buttons being held?
+inline bool ButtonsAreChorded() {
+  return channel_state[0].button_state && channel_state[1].button_state;
 }
 
 // For the given channel, record a button press start
-inline void ButtonHandleNewlyPressed(uint8_t channel) {
-  button_last_press_at[channel] = TCNT1;
-  button_is_inhibited[channel] = false;
+inline void ButtonHandleNewlyPressed(ChannelState* c) {
+  c->button_last_press_at = ClockNow();
+  c->button_is_inhibited = false;
 }
 
 // For the given channel, is the button in a new state than it was last cycle?
 inline bool ButtonIsNewState(uint8_t channel) {
+  ChannelState* c = &channel_state[channel];
   bool input_state = ButtonRead(channel);
-  if (!button_state[channel] && input_state) {
-    ButtonHandleNewlyPressed(channel);
+  if (!c->button_state && input_state) {
+    if (function_state[channel].function == CHANNEL_FUNCTION_INTERNAL_CLOCK) {
+      if (c->button_is_tap_valid) {
+        InternalClockHandleTap(channel, ClockNow() - c->button_last_press_at);
+      }
+      c->button_is_tap_valid = true;
+    }
+    ButtonHandleNewlyPressed(c);
   }
   return input_state;
 }
@@ -741,25 +2060,131 @@ inline bool ButtonIsNewState(uint8_t channel) {
 // Scan the button state and execute any actions accordingly
 void ButtonsScanAndExec() {
   for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
+    ChannelState* c = &channel_state[i];
+    // a tap too long ago to time the next one expires before the timer wraps around
+    if (c->button_is_tap_valid &&
+        static_cast<uint16_t>(ClockNow() - c->button_last_press_at) > INTERNAL_CLOCK_TAP_INTERVAL_MAX) {
+      c->button_is_tap_valid = false;
+    }
     bool new_input_state = ButtonIsNewState(i);
-    if (button_state[i] && !button_is_inhibited[i]) {
-      uint16_t button_press_time = (TCNT1 >= button_last_press_at[i])
-        ? TCNT1 - button_last_press_at[i]
-        : TCNT1 + (TCNT1_MAX - button_last_press_at[i]);
+    if (c->button_state && !c->button_is_inhibited) {
+      uint16_t now = ClockNow();
+      uint16_t button_press_time = (now >= c->button_last_press_at)
+        ? now - c->button_last_press_at
+        : now + (TCNT1_MAX - c->button_last_press_at);
       if (button_press_time >= BUTTON_LONG_PRESS_DURATION) {
-        button_is_inhibited[i] = true;
-        // long press
-        // toggle functions & save
-        ChannelFunctionToggle(i);
+        // a long press isn't a tap
+        c->button_is_inhibited = true;
+        c->button_is_tap_valid = false;
+        if (ButtonsAreChorded()) {
+          // long press of both buttons
+          // toggle routing & save
+          channel_state[0].button_is_inhibited = channel_state[1].button_is_inhibited = true;
+          channel_state[0].button_is_tap_valid = channel_state[1].button_is_tap_valid = false;
+          ChannelRoutingToggle();
+        } else {
+          // long press
+          // toggle functions & save
+          ChannelFunctionToggle(i);
+        }
         SystemStateSave();
-      } else if (new_input_state) {
-        // short press
+      } else if (function_state[i].function == CHANNEL_FUNCTION_LOOPER) {
+        // short press, on release
+        // arm or stop recording
+        if (!new_input_state) {
+          LooperToggleRecording(i);
+        }
+      } else if (function_state[i].function == CHANNEL_FUNCTION_INTERNAL_CLOCK) {
+        // taps are handled as the button is pressed
+      } else if (!new_input_state) {
+        // short press, on release, so that holding the button to edit the gate
+        // length doesn't reset the channel
         // do reset
-        FunctionReset(i);
+        PipelineReset(i);
       }
     }
-    button_state[i] = new_input_state;
+    if (c->button_state && !new_input_state && c->is_gate_length_edited) {
+      // released after changing the gate length
+      // save
+      c->is_gate_length_edited = false;
+      eeprom_write_byte((uint8_t*) (EEPROM_ADDRESS_GATE_LENGTH + i), c->gate_length);
+    }
+    c->button_state = new_input_state;
+  }
+}
+
+// Button change only wakes the cpu. It's handled by the loop
+EMPTY_INTERRUPT(PCINT1_vect);
+
+// Can the cpu sleep until the next interrupt?
+// Only call with interrupts disabled, so that no event comes between the check and the sleep
+inline bool SystemIsIdle() {
+  // audio rate outputs need every cycle, and a scan that came due since the loop
+  // checked would otherwise wait for the next one
+  if (AudioIsEnabled() || adc_is_scan_due) {
+    return false;
+  }
+  for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
+    ChannelState* c = &channel_state[i];
+    // inputs waiting to be handled, held buttons, taps waiting for the next one and
+    // lit LEDs are timed by the loop
+    if (gate_input[i].is_rising_edge || internal_clock[i].is_pending ||
+        c->button_state || c->button_is_tap_valid || c->led_state ||
+        looper_state[i].save_remaining) {
+      return false;
+    }
+    // triggers are ended by the loop, gates by the timer compare
+    if (c->is_trigger_extended && !GateFallIsScheduled(i)) {
+      return false;
+    }
   }
+  for (uint8_t i = 0; i < SYSTEM_NUM_FUNCTION_CHANNELS; ++i) {
+    if (FunctionIsScheduled(&function_state[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Sleep until the next interrupt if nothing is pending
+// Pin changes, the timer compares and the adc scan timer wake the cpu
+// The clocks keep running in idle mode, so waking adds 4 cycles to the usual interrupt
+// response, well under a timer tick. Inputs are timestamped by the interrupt, so
+// sleeping doesn't move them
+inline void SystemIdle() {
+  if (!system_is_idle_enabled) {
+    return;
+  }
+  cli();
+  if (SystemIsIdle()) {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    // the instruction after sei always runs, so an interrupt that's already
+    // pending wakes the cpu right away
+    sei();
+    sleep_cpu();
+    sleep_disable();
+  }
+  sei();
+}
+
+// Update the given channel from its input events and execute a single system cycle
+// An internal clock on the other channel takes the place of the trig input, and when
+// chained, the second channel takes the first one's output event instead
+// Returns whether the channel emitted an output event on this cycle
+template<uint8_t channel>
+inline bool LoopChannel(bool is_trig, uint16_t trig_at, bool is_reset, bool is_reset_first,
+                        bool is_event, uint16_t now) {
+  const uint8_t other = SYSTEM_NUM_CHANNELS - 1 - channel;
+  if (function_state[other].function == CHANNEL_FUNCTION_INTERNAL_CLOCK) {
+    ChannelStateUpdate(channel, internal_clock[other].is_tick, internal_clock[other].tick_at,
+                       is_reset, true);
+  } else if (channel > 0 && channel_routing == CHANNEL_ROUTING_CHAINED) {
+    ChannelStateUpdate(channel, is_event, now, is_reset, is_reset_first);
+  } else {
+    ChannelStateUpdate(channel, is_trig, trig_at, is_reset, is_reset_first);
+  }
+  return ChannelExec<channel>();
 }
 
 // Single system loop
@@ -771,24 +2196,53 @@ inline void Loop() {
   // Scan buttons
   ButtonsScanAndExec();
 
+  // Take internal clock ticks
+  InternalClockScan();
+
+  // Save patterns
+  LooperSaveExec();
+
+  uint16_t now = ClockNow();
+
+  // Scan reset input
+  bool is_reset = GateInputIsRisingEdge(GATE_INPUT_RESET_INDEX, now);
+  uint16_t reset_at = GateInputRisingEdgeAt(GATE_INPUT_RESET_INDEX);
+
   // Scan clock/trig/gate input
+  // A trig is held for the coincidence window, in case a reset arrives just after it,
+  // and for the minimum high time that such a reset takes to count.
+  // With a reset already pending, it's handled right away
   bool is_trig = false;
+  uint16_t trig_at = 0;
+  uint16_t trig_hold = gate_input_coincidence_window + gate_input_min_high_time +
+    (gate_input_min_high_time ? 1 : 0);
+  if (GateInputIsRisingEdge(GATE_INPUT_TRIG_INDEX, now)) {
+    trig_at = GateInputRisingEdgeAt(GATE_INPUT_TRIG_INDEX);
+    is_trig = is_reset || static_cast<uint16_t>(now - trig_at) >= trig_hold;
+  }
 
-  if (GateInputIsRisingEdge(GATE_INPUT_TRIG_INDEX)) {
-    // Pulse tracker is always recording. this should help smooth transitions
-    // between functions even though divide doesn't use it
-    PulseTrackerRecord();
-    is_trig = true;
+  // Events are handled in the order that they happened, except that a reset wins
+  // at the downbeat: one within the coincidence window after the trig goes first
+  bool is_reset_first = !is_trig ||
+    static_cast<int16_t>(reset_at - trig_at) <= gate_input_coincidence_window;
+
+  if (is_trig) {
+    GateInputClearRisingEdge(GATE_INPUT_TRIG_INDEX);
+  }
+  if (is_reset) {
+    GateInputClearRisingEdge(GATE_INPUT_RESET_INDEX);
   }
 
-  // scan reset input
-  bool is_reset = GateInputIsRisingEdge(GATE_INPUT_RESET_INDEX);
+  // The channels time a trig from when it's released rather than from its edge, so
+  // that the strikes and swing that follow the thru are delayed by the same hold
+  uint16_t trig_release_at = (static_cast<uint16_t>(now - trig_at) >= trig_hold)
+    ? trig_at + trig_hold
+    : now;
 
   // do stuff
-  for (uint8_t i = 0; i < SYSTEM_NUM_CHANNELS; ++i) {
-    ChannelStateUpdate(i, is_trig, is_reset);
-    ChannelExec(i);
-  }
+  // when chained, channel 2 sees channel 1's events in the same pass that they happen
+  bool is_event = LoopChannel<0>(is_trig, trig_release_at, is_reset, is_reset_first, false, now);
+  LoopChannel<1>(is_trig, trig_release_at, is_reset, is_reset_first, is_event, now);
 }
 
 int main(void) {
@@ -797,5 +2251,6 @@ int main(void) {
 
   while (1) {
     Loop();
+    SystemIdle();
   }
 }